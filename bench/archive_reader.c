@@ -0,0 +1,131 @@
+/*
+Reader for frame archives, and a check of them.
+
+Opens an archive the archive backend wrote, e.g.
+  LITENES_HAL=archive litenes
+  archive_reader frames.lnfa 601 197
+and walks every frame number through frame_archive_frame(). It checks:
+  - the payloads start on a page boundary and each frame lies inside
+    one of the payload_count slots,
+  - a frame that shares its payload shares it with the frame before it,
+    and a frame with a payload of its own differs from that frame, so
+    the dedup stored each run of repeated frames once,
+  - payloads are used in order, one new slot per stored frame,
+  - every pixel of every payload is a palette color,
+  - there is no frame past frame_count,
+and, when they are given, that the archive holds the expected number of
+frames and stored payloads (601 and 197 for a default run of the
+embedded ROM). Exits with 1 if any check failed.
+
+Usage: archive_reader [path] [frames] [stored]
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame-archive.h"
+#include "pixfmt.h"
+
+#define ARCHIVE_PAGE 4096
+
+// Palette colors of every bank in the archive's format, sorted for bsearch()
+static uint32_t colors[PIXFMT_BANKS * 64];
+
+static int compare_colors(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long foreign_pixels(const void *frame, unsigned pixels, unsigned bytes_per_pixel)
+{
+    unsigned long count = 0;
+    unsigned i;
+    for (i = 0; i < pixels; i++) {
+        uint32_t color = bytes_per_pixel == 2 ? ((const uint16_t *) frame)[i] : ((const uint32_t *) frame)[i];
+        if (bsearch(&color, colors, PIXFMT_BANKS * 64, sizeof(uint32_t), compare_colors) == NULL)
+            count++;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "frames.lnfa";
+    long want_frames = argc > 2 ? atol(argv[2]) : -1;
+    long want_stored = argc > 3 ? atol(argv[3]) : -1;
+    unsigned long misplaced = 0, stored_same = 0, out_of_order = 0, foreign = 0;
+    unsigned long repeats = 0, stored = 0;
+    const byte *previous = NULL, *first = NULL;
+    unsigned n, i;
+    int failed;
+
+    frame_archive *archive = frame_archive_open(path);
+    if (archive == NULL) {
+        printf("%s is not a frame archive\n", path);
+        return 1;
+    }
+    const frame_archive_header *info = frame_archive_info(archive);
+    printf("%s: %ux%u, %u bytes per pixel, %u frames, %u stored, room for %u\n", path, info->width,
+           info->height, info->bytes_per_pixel, info->frame_count, info->payload_count, info->capacity);
+    if (info->bytes_per_pixel != 2 && info->bytes_per_pixel != 4) {
+        printf("%u bytes per pixel is not a canvas format\n", info->bytes_per_pixel);
+        frame_archive_close(archive);
+        return 1;
+    }
+
+    pixfmt_init();
+    for (i = 0; i < PIXFMT_BANKS * 64; i++)
+        colors[i] = info->bytes_per_pixel == 2 ? pixfmt_rgb565[i / 64][i % 64] : pixfmt_xrgb8888[i / 64][i % 64];
+    qsort(colors, PIXFMT_BANKS * 64, sizeof(uint32_t), compare_colors);
+
+    for (n = 0; n < info->frame_count; n++) {
+        const byte *frame = frame_archive_frame(archive, n);
+        if (frame == NULL) {
+            misplaced++;
+            continue;
+        }
+        if (first == NULL) {
+            first = frame;
+            if ((uintptr_t) first % ARCHIVE_PAGE != 0)
+                misplaced++;
+        }
+        if (frame < first || (size_t) (frame - first) % info->frame_size != 0 ||
+            (size_t) (frame - first) / info->frame_size >= info->payload_count) {
+            misplaced++;
+            continue;
+        }
+
+        if (frame == previous) {
+            repeats++;
+            continue;
+        }
+        // A frame of its own goes into the next slot, and would not have
+        // been stored if it repeated the one before
+        if ((size_t) (frame - first) != stored * info->frame_size)
+            out_of_order++;
+        else if (previous != NULL && memcmp(frame, previous, info->frame_size) == 0)
+            stored_same++;
+        foreign += foreign_pixels(frame, info->width * info->height, info->bytes_per_pixel) != 0;
+        stored++;
+        previous = frame;
+    }
+    if (frame_archive_frame(archive, info->frame_count) != NULL)
+        misplaced++;
+
+    printf("%lu frames stored, %lu repeats\n", stored, repeats);
+    printf("%lu misplaced, %lu out of order, %lu stored twice, %lu with colors not in the palette\n",
+           misplaced, out_of_order, stored_same, foreign);
+    failed = misplaced || out_of_order || stored_same || foreign || stored != info->payload_count;
+    if (want_frames >= 0 && info->frame_count != (unsigned long) want_frames) {
+        printf("expected %ld frames\n", want_frames);
+        failed = 1;
+    }
+    if (want_stored >= 0 && info->payload_count != (unsigned long) want_stored) {
+        printf("expected %ld stored\n", want_stored);
+        failed = 1;
+    }
+    frame_archive_close(archive);
+    return failed;
+}
@@ -0,0 +1,278 @@
+/*
+Microbenchmark for the palette conversion stage.
+
+Compares pixfmt_convert_frame() on a 256x240 index frame, with the
+scalar and the SIMD converters. Rows cycle through the eight emphasis
+banks. Also times pixfmt_lookup_line() on one byte plane, as the Y4M
+stream backend uses it.
+
+The canvas rows compare how the 320x240 RGB565 canvas used to be drawn
+(backdrop fill, color_map[] store for every pixel of a PixelBuf, the
+frame counter, the copy out and the post-flip refill) against
+canvas_compose(), which hal.c draws it with, into eight canvases in turn
+as the frame writer recycles its buffers. "written" is the bytes stored
+per frame, counted as they are stored; canvas_compose() returns its
+count. The compose path is also timed with the backdrop the same every
+frame and changing every time a canvas is reused, and the bench fails
+if keeping the backdrop does not save the border stores.
+
+The upscale rows time upscale_convert_frame() for each mode and format,
+scalar and SIMD, converting and scaling in the one pass.
+
+Before timing anything it checks the emphasis banks against the palette:
+each channel keeps its value or is dimmed to 3/4 as the bank says.
+
+Usage: bench_pixfmt [frames]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "canvas.h"
+#include "fce.h"
+#include "nes.h"
+#include "pixfmt.h"
+#include "upscale.h"
+
+static byte index_frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+static byte banks[SCREEN_HEIGHT];
+static int xyc_list[SCREEN_WIDTH * SCREEN_HEIGHT];
+static uint16_t canvas[CANVAS_WIDTH * CANVAS_HEIGHT];
+static uint16_t canvas_out[CANVAS_WIDTH * CANVAS_HEIGHT];
+static uint16_t canvases[CANVAS_BORDER_CACHE][CANVAS_WIDTH * CANVAS_HEIGHT];
+static byte out[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
+static byte ref[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
+static byte plane_table[64];
+static byte scaled[SCREEN_WIDTH * SCREEN_HEIGHT * 4 * 16];
+static byte scaled_ref[SCREEN_WIDTH * SCREEN_HEIGHT * 4 * 16];
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Bytes the canvas paths below have stored
+static long canvas_written;
+
+// The path nes_set_bg_color + nes_flush_buf + nes_flip_display used to
+// take: fill the whole canvas with the backdrop, store every pixel through
+// color_map[], stamp the frame counter, copy the canvas out (to the VRAM,
+// or the dump file), then fill it with the backdrop again
+static void old_frame(int bg)
+{
+    int *fbuf = (int *) canvas;
+    int bgc = pixfmt_rgb565[0][bg];
+    int i;
+    for (i = 0; i < CANVAS_HEIGHT * CANVAS_WIDTH / 2; ++i)
+        fbuf[i] = bgc << 16 | bgc;
+    canvas_written += sizeof(canvas);
+    for (i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+        int xyc = xyc_list[i];
+        int x = ((xyc & 0xFFF00000) >> 20) + CANVAS_X_OFFSET;
+        int y = (xyc & 0xFFF00) >> 8;
+        canvas[y * CANVAS_WIDTH + x] = pixfmt_rgb565[0][xyc & 0x3F];
+    }
+    canvas_written += SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint16_t);
+    canvas_written += canvas_draw_counter(PIXFMT_RGB565, canvas, CANVAS_X_OFFSET, 4, bg);
+    memcpy(canvas_out, canvas, sizeof(canvas));
+    canvas_written += sizeof(canvas);
+    for (i = 0; i < CANVAS_HEIGHT * CANVAS_WIDTH / 2; ++i)
+        fbuf[i] = bgc << 16 | bgc;
+    canvas_written += sizeof(canvas);
+}
+
+// hal.c's compose_canvas(), into the canvases in turn as the frame writer
+// recycles its buffers
+static void compose_frame(int f, int bg)
+{
+    canvas_written += canvas_compose(PIXFMT_RGB565, canvases[f % CANVAS_BORDER_CACHE], index_frame[0], banks, bg, f);
+}
+
+static void convert(pixfmt fmt)
+{
+    int bpp = pixfmt_bytes_per_pixel(fmt);
+    pixfmt_convert_frame(fmt, index_frame[0], SCREEN_WIDTH, banks, out, SCREEN_WIDTH * bpp, SCREEN_WIDTH, SCREEN_HEIGHT);
+}
+
+static void lookup_plane()
+{
+    int y;
+    for (y = 0; y < SCREEN_HEIGHT; y++)
+        pixfmt_lookup_line(plane_table, index_frame[y], out + y * SCREEN_WIDTH, SCREEN_WIDTH);
+}
+
+static void upscale(upscale_mode mode, pixfmt fmt)
+{
+    int pitch = SCREEN_WIDTH * upscale_factor(mode) * pixfmt_bytes_per_pixel(fmt);
+    upscale_convert_frame(mode, fmt, index_frame[0], SCREEN_WIDTH, banks, scaled, pitch, SCREEN_WIDTH, SCREEN_HEIGHT);
+}
+
+// Channels each bank dims, bit 0 red, bit 1 green, bit 2 blue: those whose
+// own emphasis bit is clear, and all of them when every bit is set
+static const int bank_dims[PIXFMT_BANKS] = { 0, 6, 5, 4, 3, 2, 1, 7 };
+
+static int check_banks()
+{
+    int bank, i, channel;
+    for (bank = 0; bank < PIXFMT_BANKS; bank++) {
+        for (i = 0; i < 64; i++) {
+            int values[3] = { palette[i].r, palette[i].g, palette[i].b };
+            for (channel = 0; channel < 3; channel++) {
+                int expected = bank_dims[bank] & (1 << channel) ? values[channel] * 3 / 4 : values[channel];
+                int actual = (pixfmt_xrgb8888[bank][i] >> (16 - 8 * channel)) & 0xFF;
+                if (actual != expected) {
+                    printf("bank %d color %02x channel %d: %d, expected %d\n", bank, i, channel, actual, expected);
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+static void report(const char *name, double seconds, int frames, int bytes_per_frame, int bytes_written)
+{
+    double us = seconds * 1e6 / frames;
+    printf("%-30s %9.1f us/frame  %8.1f MB/s out  %6.1f KB written\n",
+           name, us, bytes_per_frame / us, bytes_written / 1024.0);
+}
+
+int main(int argc, char *argv[])
+{
+    static const pixfmt fmts[3] = { PIXFMT_RGB565, PIXFMT_RGB888, PIXFMT_XRGB8888 };
+    static const char *names[3] = { "rgb565", "rgb888", "xrgb8888" };
+    int frames = argc > 1 ? atoi(argv[1]) : 2000;
+    int i, f, x, y;
+    double t;
+
+    pixfmt_init();
+    if (!check_banks())
+        return 1;
+    srand(1);
+    for (y = 0; y < SCREEN_HEIGHT; y++) {
+        banks[y] = y % PIXFMT_BANKS;
+        for (x = 0; x < SCREEN_WIDTH; x++) {
+            index_frame[y][x] = rand() & 0xFF;
+            xyc_list[y * SCREEN_WIDTH + x] = (x << 20) | (y << 8) | index_frame[y][x];
+        }
+    }
+
+    // The backdrop changes once a second, as it might between scenes
+    canvas_written = 0;
+    t = now();
+    for (f = 0; f < frames; f++)
+        old_frame(f / 60 & 0x3F);
+    report("canvas rgb565 old path", now() - t, frames, sizeof(canvas), canvas_written / frames);
+    canvas_written = 0;
+    t = now();
+    for (f = 0; f < frames; f++)
+        compose_frame(f, f / 60 & 0x3F);
+    report("canvas rgb565 compose", now() - t, frames, sizeof(canvas), canvas_written / frames);
+
+    for (f = 0; f < CANVAS_BORDER_CACHE; f++)
+        compose_frame(f, 1);
+    canvas_written = 0;
+    t = now();
+    for (f = 0; f < frames; f++)
+        compose_frame(f, 1);
+    long kept = canvas_written;
+    report("canvas compose, same bg", now() - t, frames, sizeof(canvas), kept / frames);
+    canvas_written = 0;
+    t = now();
+    for (f = 0; f < frames; f++)
+        compose_frame(f, f / CANVAS_BORDER_CACHE & 1);
+    long changed = canvas_written;
+    report("canvas compose, new bg", now() - t, frames, sizeof(canvas), changed / frames);
+    if (kept >= changed) {
+        printf("canvas compose: an unchanged backdrop stored %ld bytes, a changing one %ld\n", kept, changed);
+        return 1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        int bytes = SCREEN_WIDTH * SCREEN_HEIGHT * pixfmt_bytes_per_pixel(fmts[i]);
+        char name[32];
+
+        pixfmt_disable_simd();
+        convert(fmts[i]);
+        memcpy(ref, out, bytes);
+        t = now();
+        for (f = 0; f < frames; f++)
+            convert(fmts[i]);
+        snprintf(name, sizeof(name), "convert %s scalar", names[i]);
+        report(name, now() - t, frames, bytes, bytes);
+
+        pixfmt_init();
+        memset(out, 0, bytes);
+        convert(fmts[i]);
+        if (memcmp(ref, out, bytes)) {
+            printf("convert %s: SIMD output differs from scalar\n", names[i]);
+            return 1;
+        }
+        t = now();
+        for (f = 0; f < frames; f++)
+            convert(fmts[i]);
+        snprintf(name, sizeof(name), "convert %s simd", names[i]);
+        report(name, now() - t, frames, bytes, bytes);
+    }
+
+    for (i = 0; i < 64; i++)
+        plane_table[i] = 16 + i * 3;
+    pixfmt_disable_simd();
+    lookup_plane();
+    memcpy(ref, out, SCREEN_WIDTH * SCREEN_HEIGHT);
+    t = now();
+    for (f = 0; f < frames; f++)
+        lookup_plane();
+    report("lookup plane scalar", now() - t, frames, SCREEN_WIDTH * SCREEN_HEIGHT, SCREEN_WIDTH * SCREEN_HEIGHT);
+
+    pixfmt_init();
+    memset(out, 0, SCREEN_WIDTH * SCREEN_HEIGHT);
+    lookup_plane();
+    if (memcmp(ref, out, SCREEN_WIDTH * SCREEN_HEIGHT)) {
+        printf("lookup plane: SIMD output differs from scalar\n");
+        return 1;
+    }
+    t = now();
+    for (f = 0; f < frames; f++)
+        lookup_plane();
+    report("lookup plane simd", now() - t, frames, SCREEN_WIDTH * SCREEN_HEIGHT, SCREEN_WIDTH * SCREEN_HEIGHT);
+
+    static const upscale_mode modes[4] = { UPSCALE_2X, UPSCALE_3X, UPSCALE_4X, UPSCALE_SCALE2X };
+    static const char *mode_names[4] = { "2x", "3x", "4x", "scale2x" };
+    int m;
+    upscale_init();
+    for (m = 0; m < 4; m++) {
+        for (i = 0; i < 3; i++) {
+            int factor = upscale_factor(modes[m]);
+            int bytes = SCREEN_WIDTH * SCREEN_HEIGHT * factor * factor * pixfmt_bytes_per_pixel(fmts[i]);
+            int n = frames / (factor * factor);
+            char name[32];
+
+            upscale_disable_simd();
+            upscale(modes[m], fmts[i]);
+            memcpy(scaled_ref, scaled, bytes);
+            t = now();
+            for (f = 0; f < n; f++)
+                upscale(modes[m], fmts[i]);
+            snprintf(name, sizeof(name), "upscale %s %s scalar", mode_names[m], names[i]);
+            report(name, now() - t, n, bytes, bytes);
+
+            upscale_init();
+            memset(scaled, 0, bytes);
+            upscale(modes[m], fmts[i]);
+            if (memcmp(scaled_ref, scaled, bytes)) {
+                printf("upscale %s %s: SIMD output differs from scalar\n", mode_names[m], names[i]);
+                return 1;
+            }
+            t = now();
+            for (f = 0; f < n; f++)
+                upscale(modes[m], fmts[i]);
+            snprintf(name, sizeof(name), "upscale %s %s simd", mode_names[m], names[i]);
+            report(name, now() - t, n, bytes, bytes);
+        }
+    }
+    return 0;
+}
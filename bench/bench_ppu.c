@@ -0,0 +1,84 @@
+/*
+Benchmark for the PPU backends.
+
+Built once per backend (bench_ppu_scanline, bench_ppu_dot), each runs the
+embedded ROM for a number of frames with a HAL that only keeps the frame
+in memory, and reports the time per frame and a checksum of the frames.
+Run both to compare them.
+
+Usage: bench_ppu_<backend> [frames]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fce.h"
+#include "hal.h"
+#include "ppu.h"
+
+extern char rom[];
+
+static byte index_frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+static byte index_emphasis[SCREEN_HEIGHT];
+static unsigned long checksum = 2166136261u;
+static int flips;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// HAL
+
+void nes_hal_init() { }
+void wait_for_frame() { }
+bool nes_hal_done() { return false; }
+void nes_set_bg_color(int c) { (void) c; }
+int nes_key_state(int b) { (void) b; return 0; }
+
+void nes_flush_scanline(int y, const byte *line, int emphasis)
+{
+    memcpy(index_frame[y], line, SCREEN_WIDTH);
+    index_emphasis[y] = emphasis;
+}
+
+void nes_flip_display()
+{
+    const byte *pixel = index_frame[0];
+    int i;
+
+    for (i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+        checksum = ((checksum ^ pixel[i]) * 16777619u) & 0xFFFFFFFFu;
+    for (i = 0; i < SCREEN_HEIGHT; i++)
+        checksum = ((checksum ^ index_emphasis[i]) * 16777619u) & 0xFFFFFFFFu;
+    flips++;
+}
+
+void nes_submit_frame_packet(ppu_frame_packet *packet)
+{
+    ppu_render_packet(packet);
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 600;
+    double t;
+
+    if (fce_load_rom(rom) != 0) {
+        printf("failed to load the ROM\n");
+        return 1;
+    }
+    fce_init();
+
+    t = now();
+    while (ppu_frame_count() < (unsigned long) frames)
+        fce_run_frame();
+    t = now() - t;
+
+    printf("%-8s PPU: %d frames, %9.1f us/frame, %7.1f fps, checksum %08lx\n",
+           BENCH_PPU_NAME, flips, t * 1e6 / frames, frames / t, checksum);
+    return 0;
+}
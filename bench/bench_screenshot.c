@@ -0,0 +1,111 @@
+/*
+Benchmark for the screenshot encoders.
+
+Runs the embedded ROM for 600 frames with a HAL that keeps every 60th
+frame, then encodes those ten frames over and over in each format and
+reports the time per screenshot and the average size. Given a prefix,
+it also writes the ten screenshots of each format, named
+<prefix><frame><extension>, for checking them with other tools.
+
+Usage: bench_screenshot [rounds] [prefix]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fce.h"
+#include "hal.h"
+#include "pixfmt.h"
+#include "ppu.h"
+#include "screenshot.h"
+
+#define BENCH_FRAMES 600
+#define BENCH_EVERY 60
+#define BENCH_SHOTS (BENCH_FRAMES / BENCH_EVERY)
+
+extern char rom[];
+
+static byte index_frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+static byte index_emphasis[SCREEN_HEIGHT];
+static byte shots[BENCH_SHOTS][SCREEN_HEIGHT][SCREEN_WIDTH];
+static byte shot_banks[BENCH_SHOTS][SCREEN_HEIGHT];
+static int flips;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// HAL
+
+void nes_hal_init() { }
+void wait_for_frame() { }
+bool nes_hal_done() { return false; }
+void nes_set_bg_color(int c) { (void) c; }
+int nes_key_state(int b) { (void) b; return 0; }
+
+void nes_flush_scanline(int y, const byte *line, int emphasis)
+{
+    memcpy(index_frame[y], line, SCREEN_WIDTH);
+    index_emphasis[y] = emphasis;
+}
+
+void nes_flip_display()
+{
+    if (++flips % BENCH_EVERY == 0 && flips / BENCH_EVERY <= BENCH_SHOTS) {
+        memcpy(shots[flips / BENCH_EVERY - 1], index_frame, sizeof(index_frame));
+        memcpy(shot_banks[flips / BENCH_EVERY - 1], index_emphasis, sizeof(index_emphasis));
+    }
+}
+
+void nes_submit_frame_packet(ppu_frame_packet *packet)
+{
+    ppu_render_packet(packet);
+}
+
+int main(int argc, char *argv[])
+{
+    static const screenshot_format formats[3] = { SCREENSHOT_PNG, SCREENSHOT_PNG_STORED, SCREENSHOT_QOI };
+    static const char *names[3] = { "png", "png stored", "qoi" };
+    int rounds = argc > 1 ? atoi(argv[1]) : 100;
+    int i, r, s;
+
+    if (fce_load_rom(rom) != 0) {
+        printf("failed to load the ROM\n");
+        return 1;
+    }
+    fce_init();
+    while (ppu_frame_count() < BENCH_FRAMES)
+        fce_run_frame();
+
+    pixfmt_init();
+    screenshot_init();
+    for (i = 0; i < 3; i++) {
+        byte *out = malloc(screenshot_max_size(formats[i]));
+        size_t bytes = 0;
+        double t = now();
+        for (r = 0; r < rounds; r++)
+            for (s = 0; s < BENCH_SHOTS; s++)
+                bytes += screenshot_encode(formats[i], shots[s][0], shot_banks[s], out);
+        t = now() - t;
+        printf("screenshot %-12s %7.1f us/shot  %8.1f KB/shot\n", names[i],
+               t * 1e6 / (rounds * BENCH_SHOTS), bytes / 1024.0 / (rounds * BENCH_SHOTS));
+        free(out);
+
+        if (argc > 2) {
+            for (s = 0; s < BENCH_SHOTS; s++) {
+                char path[256];
+                snprintf(path, sizeof(path), "%s%d%s", argv[2], (s + 1) * BENCH_EVERY,
+                         formats[i] == SCREENSHOT_PNG_STORED ? "-stored.png" : screenshot_extension(formats[i]));
+                if (!screenshot_write(path, formats[i], shots[s][0], shot_banks[s])) {
+                    printf("failed to write %s\n", path);
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
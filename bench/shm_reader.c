@@ -0,0 +1,139 @@
+/*
+Reader for the shared-memory frame ring, and a check of it.
+
+Attaches to the ring of a running writer, e.g.
+  LITENES_HAL=shm LITENES_SHM_SLOTS=2 LITENES_SPEED=0 litenes &
+  shm_reader /litenes 2000 200
+and copies the latest frame over and over until it has read the given
+number of frames or the writer has published nothing for a second. It
+waits for the first frame with frame_shm_copy_latest(); after that each
+copy goes through frame_shm_latest() and frame_shm_valid(), optionally
+sleeping delay_us in the middle to make the writer lap it. It checks:
+  - frame numbers never go backwards,
+  - every pixel of an XRGB8888 frame is a palette color,
+  - the slot copied a second time, with the ticket still valid, has the
+    same checksum, so no frame changed under a read the seqlock let by.
+Exits with 1 if any check failed.
+
+Usage: shm_reader [name] [frames] [delay_us]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame-shm.h"
+#include "pixfmt.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t checksum(const byte *p, size_t n)
+{
+    uint64_t hash = 14695981039346656037u;
+    while (n--)
+        hash = (hash ^ *p++) * 1099511628211u;
+    return hash;
+}
+
+// Palette colors of every bank, sorted for bsearch()
+static uint32_t colors[PIXFMT_BANKS * 64];
+
+static int compare_colors(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long foreign_pixels(const uint32_t *frame, size_t n)
+{
+    unsigned long count = 0;
+    while (n--) {
+        if (bsearch(frame++, colors, PIXFMT_BANKS * 64, sizeof(uint32_t), compare_colors) == NULL)
+            count++;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = argc > 1 ? argv[1] : "/litenes";
+    unsigned wanted = argc > 2 ? atoi(argv[2]) : 1000;
+    int delay_us = argc > 3 ? atoi(argv[3]) : 0;
+    unsigned long read = 0, skipped = 0, retries = 0, backwards = 0, foreign = 0, rereads = 0, torn = 0;
+    frame_shm *shm;
+    double t;
+
+    pixfmt_init();
+    memcpy(colors, pixfmt_xrgb8888, sizeof(colors));
+    qsort(colors, PIXFMT_BANKS * 64, sizeof(uint32_t), compare_colors);
+
+    // The writer may not have created the ring yet
+    t = now();
+    while ((shm = frame_shm_open(name)) == NULL) {
+        if (now() - t > 5) {
+            printf("no frame ring %s\n", name);
+            return 1;
+        }
+        usleep(1000);
+    }
+
+    const frame_shm_header *info = frame_shm_info(shm);
+    printf("%s: %ux%u, %u bytes per pixel, %u slots\n", name, info->width, info->height,
+           info->bytes_per_pixel, info->slots);
+    byte *frame = malloc(info->frame_size), *again = malloc(info->frame_size);
+    unsigned last = 0;
+    double last_new = now();
+
+    while (frame_shm_copy_latest(shm, frame) == 0) {
+        if (now() - last_new > 5) {
+            printf("no frame published\n");
+            return 1;
+        }
+        usleep(1000);
+    }
+
+    while (read < wanted && now() - last_new < 1) {
+        frame_shm_ticket ticket;
+        const void *latest = frame_shm_latest(shm, &ticket);
+        if (latest == NULL || ticket.frame == last) {
+            usleep(100);
+            continue;
+        }
+        memcpy(frame, latest, info->frame_size);
+        if (delay_us > 0)
+            usleep(delay_us);
+        if (!frame_shm_valid(shm, &ticket)) {
+            retries++;
+            continue;
+        }
+
+        if (ticket.frame < last)
+            backwards++;
+        else if (last != 0)
+            skipped += ticket.frame - last - 1;
+        last = ticket.frame;
+        last_new = now();
+        read++;
+
+        if (info->bytes_per_pixel == 4)
+            foreign += foreign_pixels((const uint32_t *) frame, info->frame_size / 4) != 0;
+        memcpy(again, latest, info->frame_size);
+        if (frame_shm_valid(shm, &ticket)) {
+            rereads++;
+            torn += checksum(frame, info->frame_size) != checksum(again, info->frame_size);
+        }
+    }
+
+    printf("%lu frames read, %lu skipped, %lu retries, %lu read again\n", read, skipped, retries, rereads);
+    printf("%lu out of order, %lu with colors not in the palette, %lu torn\n", backwards, foreign, torn);
+    frame_shm_close(shm);
+    free(frame);
+    free(again);
+    return backwards || foreign || torn || read == 0;
+}
@@ -0,0 +1,35 @@
+#include "common.h"
+
+#ifndef CANVAS_H
+#define CANVAS_H
+
+#include <stddef.h>
+
+#include "nes.h"
+#include "pixfmt.h"
+
+// The canvas the dump, archive and YATCPU backends draw: the NES picture
+// in the middle of a 320x240 RGB565 or XRGB8888 buffer, with a border of
+// the backdrop color on either side
+#define CANVAS_WIDTH 320
+#define CANVAS_HEIGHT 240
+#define CANVAS_X_OFFSET 32
+
+// Converts a frame of color codes, each row with its emphasis bank, into
+// the middle of a canvas, row by row in one pass, with the backdrop on
+// either side. The borders are skipped when they hold the backdrop
+// already: the last CANVAS_BORDER_CACHE canvases drawn are remembered.
+// Returns the bytes stored into the canvas.
+#define CANVAS_BORDER_CACHE 8
+size_t canvas_convert_frame(pixfmt fmt, void *canvas, const byte *frame, const byte *emphasis, int backdrop);
+
+// Stamps value in eight hex digits, white, with the top left corner at
+// (x, y). Returns the bytes stored.
+size_t canvas_draw_counter(pixfmt fmt, void *canvas, int x, int y, unsigned value);
+
+// Converts the frame and stamps the frame counter at the top left of the
+// picture. Returns the bytes stored.
+size_t canvas_compose(pixfmt fmt, void *canvas, const byte *frame, const byte *emphasis, int backdrop,
+                      unsigned counter);
+
+#endif
@@ -38,7 +38,7 @@ extern byte op_code;             // Current instruction code
 extern int op_value, op_address; // Arguments for current instruction
 extern int op_cycles;            // Additional instruction cycles used (e.g. when paging occurs)
 
-extern unsigned long long cpu_cycles;  // Total CPU Cycles Since Power Up (wraps)
+extern unsigned long long cpu_cycles;  // Total CPU Cycles Since Power Up
 
 extern void (*cpu_op_address_mode[256])();       // Array of address modes
 extern void (*cpu_op_handler[256])();            // Array of instruction function pointers
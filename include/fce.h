@@ -4,6 +4,7 @@
 int fce_load_rom(char *rom);
 void fce_init();
 void fce_run();
+void fce_run_frame(); // one frame of fce_run(), without waiting for the timer
 void fce_update_screen();
 
 
@@ -0,0 +1,63 @@
+#include "common.h"
+
+#ifndef FRAME_ARCHIVE_H
+#define FRAME_ARCHIVE_H
+
+// Frame archive: a whole capture in one memory-mapped file. The file is
+// preallocated for a fixed number of frames and holds a header, a frame
+// index and the frame payloads. A frame identical to the one before it
+// takes an index entry but no payload. All fields are native endian.
+// bench/archive_reader.c reads an archive back and checks it.
+
+#define FRAME_ARCHIVE_MAGIC "LNFARCH"
+#define FRAME_ARCHIVE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height, bytes_per_pixel;
+    uint32_t frame_size;     // bytes per payload, width * height * bytes_per_pixel
+    uint32_t capacity;       // index entries and payloads preallocated
+    uint32_t frame_count;    // index entries in use
+    uint32_t payload_count;  // payloads in use
+    uint32_t payload_offset; // file offset of payload 0, page aligned
+} frame_archive_header;
+
+typedef struct {
+    uint32_t payload;  // payload holding the frame
+    uint32_t reserved;
+    uint64_t hash;
+} frame_archive_entry;
+
+typedef struct frame_archive frame_archive;
+
+// Writing
+
+// Creates the file, replacing any, with room for capacity frames. NULL if
+// capacity is 0 or the file cannot be created or mapped.
+frame_archive *frame_archive_create(const char *path, int width, int height,
+                                    int bytes_per_pixel, unsigned capacity);
+
+// Payload the next frame can be drawn into in place, NULL when the
+// archive is full. frame_archive_commit() adds it to the index; if it is
+// identical to the previous frame the payload is used again next time.
+void *frame_archive_next(frame_archive *archive);
+void frame_archive_commit(frame_archive *archive);
+
+// Copies a frame in and commits it. Returns false when the archive is full.
+bool frame_archive_append(frame_archive *archive, const void *frame);
+
+// Reading
+
+// Maps an existing archive read only. NULL if it is not one.
+frame_archive *frame_archive_open(const char *path);
+
+const frame_archive_header *frame_archive_info(const frame_archive *archive);
+
+// Frame n, pointing into the mapping, NULL if there is no such frame
+const void *frame_archive_frame(const frame_archive *archive, unsigned n);
+
+// Unmaps the archive. A created one is cut down to the frames it holds.
+void frame_archive_close(frame_archive *archive);
+
+#endif
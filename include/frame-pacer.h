@@ -0,0 +1,38 @@
+#include "common.h"
+
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+// Frame pacer: starts each frame on a deadline of the NTSC frame rate,
+// 39375000 / 655171 = 60.0988 Hz, or a multiple of it. Deadlines are
+// absolute, counted from the first frame, so rounding and oversleeping
+// never add up to drift. It sleeps with clock_nanosleep() until shortly
+// before the deadline and spins for the rest.
+
+#define FRAME_PACER_NTSC_NS (1e9 * 655171 / 39375000)
+
+typedef struct {
+    unsigned long frames;  // frames paced
+    unsigned long late;    // frames already past their deadline when waited for
+    unsigned long resyncs; // times the deadlines started over after a stall
+    double fps;            // frame rate achieved since the deadlines last started
+    // How long after its deadline each frame started, late ones included
+    long min_ns, max_ns;
+    double mean_ns;
+    long p50_ns, p99_ns, p999_ns;
+} frame_pacer_stats;
+
+// Speed as a multiple of the NTSC rate, 1 by default: 2 runs twice as
+// fast, 0 unthrottled (frame_pacer_wait() returns at once)
+void frame_pacer_set_speed(double speed);
+
+// Nanoseconds before each deadline spent spinning instead of sleeping,
+// 200000 by default
+void frame_pacer_set_spin(long spin_ns);
+
+// Waits until the next frame is due
+void frame_pacer_wait();
+
+frame_pacer_stats frame_pacer_get_stats();
+
+#endif
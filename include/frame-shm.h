@@ -0,0 +1,77 @@
+#include "common.h"
+
+#ifndef FRAME_SHM_H
+#define FRAME_SHM_H
+
+// Shared-memory frame ring: the emulator publishes each finished frame
+// into one of a few slots of a POSIX shared-memory object, and any number
+// of other processes map it and read the latest frame in place. Each slot
+// has a sequence counter that is odd while the slot is being written
+// (a seqlock), so the writer never waits for readers; a reader checks the
+// counter after it is done and reads again if the frame was overwritten.
+//
+// Readers only need this header and frame-shm.c; bench/shm_reader.c is
+// one, which also checks the frames it reads. Pixels are native
+// endian, bytes_per_pixel tells the format: 2 for RGB565, 3 for R, G, B
+// bytes, 4 for 0x00RRGGBB.
+
+#define FRAME_SHM_MAGIC "LNFSHM"
+#define FRAME_SHM_VERSION 1
+#define FRAME_SHM_MAX_SLOTS 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height, bytes_per_pixel;
+    uint32_t frame_size;  // bytes per slot, width * height * bytes_per_pixel
+    uint32_t slots;
+    uint32_t slot_offset; // offset of slot 0 in the object, page aligned
+} frame_shm_header;
+
+typedef struct frame_shm frame_shm;
+
+// Writing
+
+// Creates the object (a name like "/litenes"), replacing any, with the
+// given number of slots (2 - FRAME_SHM_MAX_SLOTS). NULL on failure.
+frame_shm *frame_shm_create(const char *name, int width, int height,
+                            int bytes_per_pixel, unsigned slots);
+
+// Slot to draw the next frame into, in place. Readers see it as being
+// written until frame_shm_publish() makes it the latest frame.
+void *frame_shm_begin(frame_shm *shm);
+void frame_shm_publish(frame_shm *shm);
+
+// Frames published so far
+unsigned frame_shm_published(const frame_shm *shm);
+
+// Unmaps and removes the object; readers keep their mappings
+void frame_shm_destroy(frame_shm *shm);
+
+// Reading
+
+// Maps an existing ring read only. NULL if there is none by that name yet.
+frame_shm *frame_shm_open(const char *name);
+
+const frame_shm_header *frame_shm_info(const frame_shm *shm);
+
+// Where a frame returned by frame_shm_latest() came from
+typedef struct {
+    unsigned slot;
+    unsigned sequence;
+    unsigned frame; // frame number, counting from 1
+} frame_shm_ticket;
+
+// The latest published frame, pointing into the mapping, NULL if none has
+// been published yet. The frame is only good if frame_shm_valid() still
+// says so once the reader is done with it.
+const void *frame_shm_latest(const frame_shm *shm, frame_shm_ticket *ticket);
+bool frame_shm_valid(const frame_shm *shm, const frame_shm_ticket *ticket);
+
+// Copies the latest frame out, reading again until it gets a whole one.
+// Returns its frame number, 0 if none has been published yet.
+unsigned frame_shm_copy_latest(const frame_shm *shm, void *dst);
+
+void frame_shm_close(frame_shm *shm);
+
+#endif
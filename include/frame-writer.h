@@ -0,0 +1,46 @@
+#include "common.h"
+
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <stddef.h>
+
+// What frame_writer_acquire() does when every buffer is still queued
+typedef enum {
+    FRAME_WRITER_BLOCK, // wait for the writer, no frame is lost
+    FRAME_WRITER_DROP   // return NULL at once, the frame is not written
+} frame_writer_policy;
+
+typedef struct {
+    unsigned long written, dropped;
+    unsigned long blocked; // acquires that had to wait for the writer
+    unsigned long batches; // times the writer woke up to frames
+} frame_writer_stats;
+
+// Settings for the next frame_writer_start(): the backpressure policy
+// (FRAME_WRITER_BLOCK by default), and a file to stream every frame into
+// back to back instead of one file per frame (NULL by default)
+void frame_writer_set_policy(frame_writer_policy policy);
+void frame_writer_set_stream(const char *path);
+
+// Like frame_writer_set_stream(), with a file descriptor that is already
+// open (a pipe, say). The writer closes it when it finishes.
+void frame_writer_set_stream_fd(int fd);
+
+// Starts the writer thread with buffers of frame_size bytes. Without a
+// stream file frame n goes to a file named by name_format (a printf
+// format taking n). Returns false if anything could not be set up.
+bool frame_writer_start(size_t frame_size, const char *name_format);
+
+// Buffer for the next frame, to be filled and passed to
+// frame_writer_submit(). NULL when the frame is dropped.
+void *frame_writer_acquire();
+void frame_writer_submit(int frame_number);
+
+// Writes out every queued frame and stops the writer thread
+void frame_writer_finish();
+
+// Exact once frame_writer_finish() has returned
+frame_writer_stats frame_writer_get_stats();
+
+#endif
@@ -1,45 +1,24 @@
 #ifndef __HAL_H__
 #define __HAL_H__
 
+#include "common.h"
 #include "nes.h"
+#include "ppu.h"
+#ifndef YATCPU
+#include "video-stream.h"
+#include "upscale.h"
+#include "screenshot.h"
+#endif
 
-struct Pixel {
-	int xyc;
-};
-typedef struct Pixel Pixel;
-
-/* A buffer of pixels */
-struct PixelBuf {
-	Pixel buf[264 * 264];
-	int size;
-};
-typedef struct PixelBuf PixelBuf;
-
-extern PixelBuf bg, bbg, fg;
-
-// clear a pixel buffer
-#define pixbuf_clean(bf) \
-	do { \
-		(bf).size = 0; \
-	} while (0)
-
-// add a pending pixel into a buffer
-#define pixbuf_add(bf, xa, ya, ca) \
-	do { \
-		if ((xa) < SCREEN_WIDTH && (ya) < SCREEN_HEIGHT) { \
-			int xyc = ((xa) << 20) | ((ya) << 8) | ((ca)); \
-			(bf).buf[(bf).size].xyc = (xyc); \
-			(bf).size++; \
-		} \
-	} while (0)
-
-// fill the screen with background color
+// set the backdrop color shown around the NES picture
 void nes_set_bg_color(int c);
 
-// flush pixel buffer to frame buffer
-void nes_flush_buf(PixelBuf *buf);
+// flush scanline y, SCREEN_WIDTH NES color codes, to the frame buffer,
+// with its color emphasis (PPUMASK bits 5 - 7, a pixfmt bank); scanlines
+// not flushed in a frame keep their previous content
+void nes_flush_scanline(int y, const byte *line, int emphasis);
 
-// display and empty the current frame buffer
+// display the current frame buffer
 void nes_flip_display();
 
 // initialization
@@ -48,4 +27,80 @@ void nes_hal_init();
 // query key-press status
 int nes_key_state(int b);
 
+// have a recorded frame rendered; returns once the previously submitted
+// packet is done (pipelined rendering only)
+void nes_submit_frame_packet(ppu_frame_packet *packet);
+
+// HAL backends: the functions above, bar the frame packet ones, forward to
+// the current backend (see hal.c). Pick it before fce_init().
+typedef struct {
+    const char *name;
+    void (*init)();
+    void (*set_bg_color)(int c);
+    void (*flush_scanline)(int y, const byte *line, int emphasis);
+    void (*flip_display)();
+    void (*wait_for_frame)();
+    int (*key_state)(int b);
+    void (*finish)();
+} nes_hal_backend;
+
+extern const nes_hal_backend nes_hal_null;
+#ifdef YATCPU
+extern const nes_hal_backend nes_hal_yatcpu;
+#else
+extern const nes_hal_backend nes_hal_dump;
+extern const nes_hal_backend nes_hal_archive;
+
+// file the archive backend writes and the frames it holds before the
+// emulator exits (frames.lnfa and 601 by default)
+void nes_set_archive_output(const char *path, int frames);
+
+extern const nes_hal_backend nes_hal_stream;
+
+// file the stream backend writes to, "-" for stdout (the default), and
+// its format (VIDEO_STREAM_Y4M by default)
+void nes_set_stream_output(const char *path, video_stream_format format);
+
+extern const nes_hal_backend nes_hal_shm;
+
+// POSIX shared-memory object the shm backend publishes frames in, and its
+// number of slots ("/litenes" and 4 by default, see frame-shm.h)
+void nes_set_shm_output(const char *name, unsigned slots);
+
+// scaling of the frames the shm backend publishes (UPSCALE_NONE by
+// default), which makes them upscale_factor(mode) times as wide and high
+void nes_set_shm_scale(upscale_mode mode);
+
+// screenshots of the NES picture, written to <prefix><frame><extension>:
+// one of every interval frames (0 for none) and one of the frame after
+// each nes_request_screenshot(). The null backend keeps no picture to
+// take them of.
+void nes_set_screenshot_output(const char *prefix, screenshot_format format, unsigned interval);
+
+// takes a screenshot of the next frame; safe to call from a signal handler
+void nes_request_screenshot();
+#endif
+
+void nes_set_hal_backend(const nes_hal_backend *backend);
+
+// let the backend finish its output before the emulator exits
+void nes_hal_finish();
+
+// true once the backend has output all it is going to (the dump and
+// archive backends after their last frame); fce_run() returns then
+bool nes_hal_done();
+
+// backend with the given name, NULL if there is none (not on YATCPU)
+const nes_hal_backend *nes_find_hal_backend(const char *name);
+
+// render frames on a thread of their own from now on (not on YATCPU)
+void nes_start_render_thread();
+
+// present frames on a thread of their own from now on, always the latest
+// complete one, while the emulator goes on with the next (not on YATCPU)
+void nes_start_present_thread();
+
+// draw each frame in bands on this many threads from now on (not on YATCPU)
+void nes_start_band_rendering(int threads);
+
 #endif
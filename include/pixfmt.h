@@ -0,0 +1,46 @@
+#include "common.h"
+
+#ifndef PIXFMT_H
+#define PIXFMT_H
+
+// Output pixel formats for the palette conversion stage
+typedef enum {
+    PIXFMT_RGB565,   // 16 bits per pixel, native endian
+    PIXFMT_RGB888,   // 24 bits per pixel, bytes in R, G, B order
+    PIXFMT_XRGB8888  // 32 bits per pixel, native endian 0x00RRGGBB
+} pixfmt;
+
+// Palette lookup tables, indexed by emphasis bank and NES color code
+// (0x00 - 0x3F). The bank is PPUMASK >> 5: bit 0 emphasizes red, bit 1
+// green and bit 2 blue, which dims the other channels. Bank 0 is the
+// plain palette.
+#define PIXFMT_BANKS 8
+
+extern uint16_t pixfmt_rgb565[PIXFMT_BANKS][64];
+extern uint32_t pixfmt_xrgb8888[PIXFMT_BANKS][64];
+
+// Builds the lookup tables and picks the fastest converter for this CPU
+void pixfmt_init();
+
+// Falls back to the scalar converters (for benchmarking and debugging)
+void pixfmt_disable_simd();
+
+int pixfmt_bytes_per_pixel(pixfmt fmt);
+
+// Converts n color codes into n pixels of the given format, with the
+// colors of an emphasis bank. Only the low 6 bits of each source byte are
+// used.
+void pixfmt_convert_line(pixfmt fmt, const byte *src, void *dst, int n, int bank);
+
+// Converts a width x height frame of color codes in one streaming pass.
+// banks holds the emphasis bank of each row, NULL for none. Pitches are
+// in bytes.
+void pixfmt_convert_frame(pixfmt fmt, const byte *src, int src_pitch, const byte *banks,
+                          void *dst, int dst_pitch, int width, int height);
+
+// Looks n color codes up in a table of 64 bytes, for outputs other than
+// RGB (one plane of a YUV palette, say). Only the low 6 bits of each
+// source byte are used.
+void pixfmt_lookup_line(const byte *table, const byte *src, byte *dst, int n);
+
+#endif
@@ -0,0 +1,167 @@
+#include "common.h"
+
+#ifndef PPU_DOT_INTERNAL_H
+#define PPU_DOT_INTERNAL_H
+
+
+// PPU Memory and State
+
+
+typedef struct {
+    byte PPUCTRL;   // $2000 write only
+    byte PPUMASK;   // $2001 write only
+    byte PPUSTATUS; // $2002 read only
+    byte OAMADDR;   // $2003 write only
+
+    // Internal scroll registers, as in ppu-internal.h: current and
+    // temporary VRAM address, fine X scroll and the write toggle
+    word v, t;
+    byte fine_x;
+    bool w;
+
+    // No $2007 read since $2002 or $2006
+    bool first_data_read;
+
+    bool ready;
+
+    int mirroring;
+    bool chr_ram;
+
+    // Next dot to run: scanline -1 (pre-render) to 260, dot 0 to 340
+    int scanline, dot;
+    bool odd_frame;
+} PPU_STATE;
+
+PPU_STATE ppu;
+
+byte ppu_latch;
+
+// PPU Bus
+
+// $0000-$3EFF in 1 KiB pages, set up by ppu_set_mirroring()
+byte *ppu_pages[16];
+
+static const byte ppu_mirroring_pages[5][4] = {
+    { 0, 0, 1, 1 }, // horizontal
+    { 0, 1, 0, 1 }, // vertical
+    { 0, 0, 0, 0 }, // single screen, lower bank
+    { 1, 1, 1, 1 }, // single screen, upper bank
+    { 0, 1, 2, 3 }  // four screen
+};
+
+static const byte ppu_palette_offsets[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x00, 0x11, 0x12, 0x13, 0x04, 0x15, 0x16, 0x17, 0x08, 0x19, 0x1A, 0x1B, 0x0C, 0x1D, 0x1E, 0x1F
+};
+
+
+
+// Timing
+
+// Dots per scanline and scanlines per frame, pre-render scanline included
+#define PPU_DOTS_PER_SCANLINE 341
+#define PPU_SCANLINES_PER_FRAME 262
+
+// CPU clock, in PPU dots, the PPU has run up to
+unsigned long long ppu_dot_clock;
+
+// Vblank NMI reached in the middle of a CPU instruction, raised once the
+// instruction is done
+bool ppu_nmi_pending;
+
+unsigned long ppu_frames;
+
+void ppu_step();
+void ppu_start_frame();
+
+
+
+// Background Pipeline
+
+// Bytes fetched for the next tile
+byte ppu_next_tile, ppu_next_attribute, ppu_next_pattern_l, ppu_next_pattern_h;
+
+// Pattern and attribute shift registers: the high byte holds the tile
+// being drawn, the low byte the next one. Attribute bits are expanded to
+// one per pixel.
+word ppu_background_l, ppu_background_h;
+word ppu_attribute_l, ppu_attribute_h;
+
+void ppu_load_background_shifters();
+void ppu_fetch_background();
+void ppu_increment_x();
+void ppu_increment_y();
+
+
+
+// Sprite Pipeline
+
+// Secondary OAM: entries of the sprites on the next scanline, in OAM order.
+// Holds up to 64 unless the sprite limit is on.
+byte ppu_secondary_oam[64][4];
+int ppu_secondary_count;
+bool ppu_secondary_has_sprite_0;
+
+// Pattern shift registers (flipped already), attributes and X counters of
+// the sprites on the current scanline
+byte ppu_sprite_l[64], ppu_sprite_h[64];
+byte ppu_sprite_attr[64], ppu_sprite_x[64];
+int ppu_sprite_count;
+bool ppu_sprite_0_loaded;
+
+bool ppu_sprite_limit;
+
+byte ppu_bit_reverse_table[256];
+
+void ppu_evaluate_sprites();
+void ppu_fetch_sprite(int i);
+void ppu_shift_sprites();
+
+
+
+// Output
+
+// Current scanline as NES color codes, grayscale applied
+byte ppu_line[256];
+
+int ppu_skip_frames;
+int ppu_skip_countdown;
+bool ppu_frame_skipped;
+
+void ppu_render_pixel();
+
+
+
+// PPUCTRL Functions
+
+word ppu_base_nametable_address();
+byte ppu_vram_address_increment();
+word ppu_sprite_pattern_table_address();
+word ppu_background_pattern_table_address();
+byte ppu_sprite_height();
+bool ppu_generates_nmi();
+
+
+
+// PPUMASK Functions
+
+bool ppu_renders_grayscale();
+bool ppu_shows_background_in_leftmost_8px();
+bool ppu_shows_sprites_in_leftmost_8px();
+bool ppu_renders();
+
+
+
+// PPUSTATUS Functions
+
+bool ppu_sprite_overflow();
+bool ppu_sprite_0_hit();
+bool ppu_in_vblank();
+
+void ppu_set_sprite_overflow(bool yesno);
+void ppu_set_sprite_0_hit(bool yesno);
+void ppu_set_in_vblank(bool yesno);
+
+
+
+#endif
@@ -3,6 +3,14 @@
 #ifndef PPU_INTERNAL_H
 #define PPU_INTERNAL_H
 
+// Renderer state each band rendering thread keeps a copy of (see
+// ppu_render_band). Freestanding builds have no thread storage and draw
+// bands one after another.
+#ifdef YATCPU
+#define PPU_THREAD_LOCAL
+#else
+#define PPU_THREAD_LOCAL __thread
+#endif
 
 // Precalculated tile high and low bytes addition for pattern tables
 byte ppu_l_h_addition_table[256][256][8];
@@ -17,16 +25,20 @@ typedef struct {
     byte PPUSTATUS; // $2002 read only
     byte OAMADDR;   // $2003 write only
     byte OAMDATA;   // $2004
-	word PPUSCROLL;
-    byte PPUSCROLL_X, PPUSCROLL_Y; // $2005 write only x2
-    word PPUADDR;   // $2006 write only x2
     word PPUDATA;   // $2007
 
-    bool scroll_received_x;
-    bool addr_received_high_byte;
+    // Internal scroll registers ($2005, $2006 write only x2): current and
+    // temporary VRAM address, laid out as 0yyy NNYY YYYX XXXX (fine Y,
+    // nametable, coarse Y, coarse X), fine X scroll, and the write toggle
+    // shared by $2005 and $2006
+    word v, t;
+    byte fine_x;
+    bool w;
+
     bool ready;
 
-    int mirroring, mirroring_xor;
+    int mirroring;
+    bool chr_ram;
 
     int x, scanline;
 } PPU_STATE;
@@ -36,7 +48,31 @@ PPU_STATE ppu;
 byte ppu_latch;
 bool ppu_sprite_hit_occured = false;
 
-word ppu_get_real_ram_address(word address);
+// PPU Bus
+
+// $0000-$3EFF in 1 KiB pages, set up by ppu_set_mirroring(). $3000-$3EFF
+// mirrors the nametable pages.
+byte *ppu_pages[16];
+
+// Physical nametable page ($2000 + 0x400 * page in PPU_RAM) behind each
+// of the four logical nametables
+byte ppu_nametable_page[4];
+
+// Physical nametable pages for each ppu_mirroring mode
+static const byte ppu_mirroring_pages[5][4] = {
+    { 0, 0, 1, 1 }, // horizontal
+    { 0, 1, 0, 1 }, // vertical
+    { 0, 0, 0, 0 }, // single screen, lower bank
+    { 1, 1, 1, 1 }, // single screen, upper bank
+    { 0, 1, 2, 3 }  // four screen
+};
+
+// Palette RAM offsets for $3F00-$3F1F, with $3F10/$3F14/$3F18/$3F1C
+// mirroring the backdrop entries
+static const byte ppu_palette_offsets[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x00, 0x11, 0x12, 0x13, 0x04, 0x15, 0x16, 0x17, 0x08, 0x19, 0x1A, 0x1B, 0x0C, 0x1D, 0x1E, 0x1F
+};
 
 
 // PPU Constants
@@ -47,12 +83,279 @@ static const word ppu_base_nametable_addresses[4] = { 0x2000, 0x2400, 0x2800, 0x
 
 // Screen State and Rendering
 
-// For sprite-0-hit checks
-byte ppu_screen_background[264][248];
+// Bit-reversed bytes, for horizontally flipped sprite opacity
+byte ppu_bit_reverse_table[256];
+
+// Registers the renderer depends on
+typedef struct {
+    word v;
+    byte fine_x, ctrl, mask;
+} ppu_render_state;
+
+// State the renderer is currently working with
+PPU_THREAD_LOCAL ppu_render_state ppu_render;
+
+
+
+// Register Log
+
+// Scanlines with pixel output
+#define PPU_SCANLINES 240
+
+// Writes that take effect within the scanline they happen on, stamped
+// with the scanline and dot (0 - 340, pixel x is output at dot x + 1).
+// The log is emptied every frame; once full, later writes only show from
+// the next scanline on.
+#define PPU_LOG_SIZE 1024
+
+typedef enum {
+    PPU_LOG_CTRL,   // value: PPUCTRL
+    PPU_LOG_MASK,   // value: PPUMASK
+    PPU_LOG_FINE_X, // value: fine X scroll
+    PPU_LOG_V       // value: v, after the second $2006 write
+} ppu_log_register;
+
+typedef struct {
+    byte scanline;
+    byte reg;
+    word dot;
+    word value;
+} ppu_log_entry;
+
+// CPU clock, in PPU dots, at which the current scanline began
+unsigned long long ppu_scanline_start_dot;
+
+void ppu_log_write(byte reg, word value);
+void ppu_start_scanline();
+void ppu_end_scanline();
+
+
+
+// Frame Packets
+
+// Renderer inputs other than registers, in the order the PPU saw them:
+// memory and setting changes, and the end of each visible scanline
+typedef enum {
+    PPU_EVENT_VRAM,         // address: offset in PPU_RAM, data: new value
+    PPU_EVENT_OAM,          // address: offset in PPU_SPRRAM, data: new value
+    PPU_EVENT_MIRRORING,    // data: ppu_mirroring
+    PPU_EVENT_SPRITE_LIMIT, // data: on or off
+    PPU_EVENT_FRAME_CACHE,  // data: on or off
+    PPU_EVENT_SCANLINE,     // address: scanline to draw
+    PPU_EVENT_FRAME         // the frame is complete, data: skipped
+} ppu_event_type;
+
+typedef struct {
+    byte type;
+    byte data;
+    word address;
+} ppu_event;
+
+// Memory changes stop being recorded PPU_PACKET_RESERVED events short of
+// the end, which keeps room for the scanline and frame events
+#define PPU_PACKET_EVENTS 32768
+#define PPU_PACKET_RESERVED 512
+
+// Everything the renderer needs to draw one frame. In direct mode the
+// events are handled as they happen and only the registers are kept.
+struct ppu_frame_packet {
+    ppu_render_state line_state[PPU_SCANLINES]; // registers at the start of each scanline
+    ppu_log_entry log[PPU_LOG_SIZE];
+    int log_count;
+    ppu_event events[PPU_PACKET_EVENTS];
+    int event_count;
+
+    // Set when memory changes were lost. The renderer then resyncs from a
+    // copy of PPU memory taken at the end of the frame.
+    bool overflow;
+    byte ram[0x4000];
+    byte sprram[0x100];
+    byte mirroring;
+};
+
+ppu_frame_packet ppu_packets[2];
+
+// Packet the PPU is recording into, and the one the renderer reads
+ppu_frame_packet *ppu_packet = &ppu_packets[0];
+ppu_frame_packet *ppu_rendered_packet = &ppu_packets[0];
+
+bool ppu_pipelined;
+
+void ppu_emit(byte type, byte data, word address);
+void ppu_submit_packet();
+void ppu_render_event(const ppu_event *event);
+
+
+
+// Renderer Memory
+
+// The renderer's own copy of PPU memory, only changed by events. It is a
+// frame behind the PPU in pipelined mode.
+byte ppu_render_ram[0x4000];
+byte ppu_render_sprram[0x100];
+byte ppu_render_nametable_page[4];
+
+// Next log entry to apply, and the scanline being drawn
+PPU_THREAD_LOCAL int ppu_log_read;
+PPU_THREAD_LOCAL int ppu_render_scanline;
+
+
+
+// CHR Tracking
+
+// Pattern table tiles (16 bytes each, $0000-$1FFF holds tiles 0 - 511) the
+// renderer has seen writes to since its caches last caught up, one bit per
+// tile, so that tiles streamed into CHR-RAM only cost the cells showing them
+dword ppu_chr_dirty[16];
+bool ppu_chr_dirty_any;
+
+void ppu_chr_write(word address);
+void ppu_chr_clear_dirty();
+
+
+
+// Nametable Cache
+
+// The four physical nametable pages pre-rendered as background line values
+// (attribute << 2 | color). Palette writes need no invalidation since
+// colors are looked up when the scanline is composed.
+byte ppu_nametable_pixels[4][240][256];
+
+// One bit per 8x8 cell (bit = tile column) that must be rendered again
+dword ppu_nametable_dirty[4][30];
+
+// Pattern table the cache was rendered with
+word ppu_nametable_pattern_table;
+
+void ppu_nametable_cache_write(word address);
+void ppu_nametable_cache_invalidate();
+void ppu_nametable_cache_sync_chr();
+void ppu_nametable_cache_validate();
+void ppu_nametable_cache_refresh(int page, int tile_y);
+void ppu_nametable_cache_prepare(const int *pages, int tile_y);
 
-// Draws current screen pixels in ppu_background_pixels & ppu_sprite_pixels and clears them
-void ppu_render_screen();
-void ppu_set_background_color(byte color);
+// Scanline buffers, holding offsets into palette RAM ($3F00 + value).
+// Background: attribute << 2 | color, transparent when color is 0.
+// Sprites: 0x10 | palette << 2 | color, plus PPU_SPRITE_BEHIND_BACKGROUND;
+// 0 when no sprite covers the pixel.
+PPU_THREAD_LOCAL byte ppu_background_line[256];
+PPU_THREAD_LOCAL byte ppu_sprite_line[256];
+
+// The composed scanline, as NES color codes
+PPU_THREAD_LOCAL byte ppu_color_line[256];
+
+#define PPU_SPRITE_BEHIND_BACKGROUND 0x20
+
+void ppu_draw_background_span(int x0, int x1, int origin);
+void ppu_draw_sprite_scanline();
+void ppu_compose_span(int x0, int x1);
+void ppu_draw_span(int x0, int x1, int origin);
+int ppu_apply_log_entry(const ppu_log_entry *entry, int x, int origin);
+void ppu_draw_scanline(int scanline);
+void ppu_present_frame(bool skipped);
+
+
+
+// Band Rendering
+
+// Packet events drawn as bands by ppu_render_band(), one per visible
+// scanline; the events before and after them are handled on their own
+int ppu_band_events_start, ppu_band_events_end;
+
+bool ppu_packet_has_bands(const ppu_frame_packet *packet);
+
+
+
+// Sprite Evaluation
+
+// OAM split into one array per field, refreshed by ppu_evaluate_sprites()
+byte ppu_oam_y[64], ppu_oam_tile[64], ppu_oam_attr[64], ppu_oam_x[64];
+
+// Sprites present on each scanline, in OAM order. A sprite at OAM y shows
+// up on scanlines y + 1 to y + height.
+byte ppu_scanline_sprites[PPU_SCANLINES][64];
+byte ppu_scanline_sprite_count[PPU_SCANLINES];
+
+// Set by OAM writes; the lists are rebuilt before the next sprite scanline
+bool ppu_oam_dirty;
+byte ppu_oam_sprite_height;
+bool ppu_sprite_limit;
+
+void ppu_evaluate_sprites();
+void ppu_fetch_sprite_row(int n, byte *l, byte *h);
+word ppu_sprite_row_address(byte tile, byte attr, int row, byte height, word pattern_table);
+
+
+
+// Sprite Status
+
+// Scanlines with more than eight sprites. The PPU keeps these itself, the
+// renderer may be a frame behind.
+bool ppu_status_overflow[PPU_SCANLINES];
+bool ppu_status_dirty = true;
+byte ppu_status_sprite_height;
+
+void ppu_evaluate_sprite_status();
+byte ppu_background_tile_opacity(int nametable, int y, int column);
+void ppu_check_sprite_0_hit();
+void ppu_update_sprite_status();
+
+
+
+// Frame Cache
+
+// Bumped by every write that changes how some scanline looks: nametables,
+// palette, OAM and CHR. Register values are kept per scanline instead.
+dword ppu_render_generation = 1;
+
+typedef struct {
+    dword generation;
+    ppu_render_state state;
+} ppu_line_digest;
+
+// Inputs each scanline was last drawn with
+ppu_line_digest ppu_line_digests[PPU_SCANLINES];
+
+bool ppu_frame_cache_enabled;
+ppu_frame_cache_stats ppu_frame_cache;
+
+// Scanlines of the frame being drawn that were reused, counted when the
+// frame is presented
+bool ppu_line_reused[PPU_SCANLINES];
+
+bool ppu_frame_cache_lookup(bool split);
+
+
+
+
+// Catch-up Mode
+
+// Scanline length in PPU dots, the PPU runs three dots per CPU cycle
+#define PPU_DOTS_PER_SCANLINE 341
+
+bool ppu_catch_up_enabled;
+
+// CPU clock, in PPU dots, at which the next scanline is due
+unsigned long long ppu_next_scanline_dot;
+
+// Vblank NMI reached while syncing in the middle of a CPU instruction,
+// raised by ppu_catch_up() once the instruction is done
+bool ppu_nmi_pending;
+
+unsigned long ppu_frames;
+
+
+
+// Frameskip
+
+int ppu_skip_frames;
+
+// Frames to skip before the next one is drawn, and whether the current one
+// is. Skipped frames send memory changes to the renderer but no scanlines.
+int ppu_skip_countdown;
+bool ppu_frame_skipped;
+
+void ppu_start_frame();
 
 
 
@@ -99,4 +402,17 @@ void ppu_set_in_vblank(bool yesno);
 
 
 
+// Render State Functions
+
+word ppu_render_sprite_pattern_table_address();
+word ppu_render_background_pattern_table_address();
+byte ppu_render_sprite_height();
+bool ppu_render_shows_background_in_leftmost_8px();
+bool ppu_render_shows_sprites_in_leftmost_8px();
+bool ppu_render_shows_background();
+bool ppu_render_shows_sprites();
+bool ppu_render_renders_grayscale();
+
+
+
 #endif
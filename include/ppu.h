@@ -17,8 +17,21 @@ void ppu_io_write(word address, byte data);
 bool ppu_generates_nmi();
 void ppu_set_generates_nmi(bool yesno);
 
+// Nametable mirroring modes, the first two match bit 0 of iNES flags 6
+typedef enum {
+    PPU_MIRRORING_HORIZONTAL = 0,
+    PPU_MIRRORING_VERTICAL = 1,
+    PPU_MIRRORING_SINGLE_SCREEN_LOW,
+    PPU_MIRRORING_SINGLE_SCREEN_HIGH,
+    PPU_MIRRORING_FOUR_SCREEN
+} ppu_mirroring;
+
 void ppu_set_mirroring(byte mirroring);
 
+// Pattern tables ($0000-$1FFF) are CHR-RAM the CPU writes through $2007,
+// rather than CHR-ROM, which ignores writes (off by default)
+void ppu_set_chr_ram(bool yesno);
+
 void ppu_run(int cycles);
 void ppu_cycle();
 int ppu_scanline();
@@ -26,6 +39,70 @@ void ppu_set_scanline(int s);
 void ppu_copy(word address, byte *source, int length);
 void ppu_sprram_write(byte data);
 
+// Frames completed since power up
+unsigned long ppu_frame_count();
+
+// Catch-up mode: instead of stepping once per scanline in lockstep with
+// the CPU, the PPU only advances to the current CPU cycle when the CPU
+// touches $2000-$2007 or $4014, and at vblank and frame end (off by default)
+void ppu_set_catch_up(bool yesno);
+bool ppu_catches_up();
+
+// Brings the PPU up to the current CPU cycle, safe in the middle of an
+// instruction. Does nothing in lockstep mode.
+void ppu_sync();
+
+// Like ppu_sync(), and raises a vblank NMI that came due. Call it only
+// between CPU instructions.
+void ppu_catch_up();
+
+// CPU cycle at which the next vblank or frame end is due
+unsigned long long ppu_next_event_cycle();
+
+// Pipelined rendering: instead of drawing scanlines as it reaches them,
+// the PPU records everything the renderer needs into a frame packet and
+// passes it to nes_submit_frame_packet() at the end of each frame. Two
+// packets take turns. ppu_render_packet() draws a packet, on any thread,
+// with the same result as direct rendering. Turn it on before fce_run().
+typedef struct ppu_frame_packet ppu_frame_packet;
+
+void ppu_set_pipelined(bool yesno);
+void ppu_render_packet(ppu_frame_packet *packet);
+
+// Band rendering: the scanlines of a packet split into bands that several
+// threads draw at once. ppu_prepare_bands() draws nothing and returns false
+// when the packet changes memory or the pattern table mid-frame, use
+// ppu_render_packet() then. Otherwise call ppu_render_band() for every band
+// 0 to bands - 1, on any threads, then ppu_finish_bands() once they are done.
+bool ppu_prepare_bands(ppu_frame_packet *packet);
+void ppu_render_band(ppu_frame_packet *packet, int band, int bands);
+void ppu_finish_bands(ppu_frame_packet *packet);
+
+// Frameskip: of every skip + 1 frames only the first is drawn and
+// presented, PPU_SKIP_ALL_FRAMES draws none. Skipped frames still get
+// vblank, sprite 0 hit and sprite overflow, so the CPU sees the same PPU
+// either way. Takes effect from the next frame (0 by default).
+#define PPU_SKIP_ALL_FRAMES -1
+
+void ppu_set_frame_skip(int skip);
+int ppu_frame_skip();
+
+// Backdrop color ($3F00) of the frame being presented
+byte ppu_backdrop_color();
+
+// Draw at most 8 sprites per scanline, like the real PPU (off by default)
+void ppu_set_sprite_limit(bool yesno);
+
+// Frame cache: scanlines whose inputs match the previous frame are not
+// drawn again, the HAL keeps showing them (off by default)
+typedef struct {
+    unsigned long frames, frames_reused;
+    unsigned long lines, lines_reused;
+} ppu_frame_cache_stats;
+
+void ppu_set_frame_cache(bool yesno);
+ppu_frame_cache_stats ppu_get_frame_cache_stats();
+
 // PPUCTRL
 bool ppu_shows_background();
 bool ppu_shows_sprites();
@@ -0,0 +1,37 @@
+#include "common.h"
+
+#ifndef SCREENSHOT_H
+#define SCREENSHOT_H
+
+#include <stddef.h>
+
+// Image formats for screenshots of the SCREEN_WIDTH x SCREEN_HEIGHT NES
+// picture, encoded in one pass straight from the frame of color codes.
+// PNGs are indexed color, with one palette entry per color code and
+// emphasis bank, whenever the frame uses at most four banks (almost
+// always); otherwise they are RGB.
+typedef enum {
+    SCREENSHOT_PNG,        // deflate with fixed Huffman codes and a greedy LZ77
+    SCREENSHOT_PNG_STORED, // deflate with stored blocks, no compression at all
+    SCREENSHOT_QOI         // the Quite OK Image format, RGB
+} screenshot_format;
+
+// Builds the palette tables from the pixfmt ones, call after pixfmt_init()
+void screenshot_init();
+
+// File name extension of the format, with the dot
+const char *screenshot_extension(screenshot_format format);
+
+// Bytes an encoded screenshot can take at most
+size_t screenshot_max_size(screenshot_format format);
+
+// Encodes a frame of color codes, each row with its emphasis bank (banks
+// may be NULL), into at most screenshot_max_size(format) bytes at out.
+// Returns the length of the image.
+size_t screenshot_encode(screenshot_format format, const byte *frame, const byte *banks, byte *out);
+
+// Encodes a frame and writes it to a file, replacing any. False if the
+// file cannot be written.
+bool screenshot_write(const char *path, screenshot_format format, const byte *frame, const byte *banks);
+
+#endif
@@ -0,0 +1,37 @@
+#include "common.h"
+
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#include "pixfmt.h"
+
+// Output scaling stage: frames of color codes converted and scaled up in
+// one pass, each source row converted once into a line buffer and its
+// scaled rows written straight into the destination
+typedef enum {
+    UPSCALE_NONE,   // 1x, plain pixfmt_convert_frame()
+    UPSCALE_2X,     // nearest neighbour
+    UPSCALE_3X,
+    UPSCALE_4X,
+    UPSCALE_SCALE2X // 2x, edges kept sharp by the scale2x/EPX rules
+} upscale_mode;
+
+// Widest source frame the scalers take
+#define UPSCALE_MAX_WIDTH 512
+
+// Picks the fastest scalers for this CPU, call after pixfmt_init()
+void upscale_init();
+
+// Falls back to the scalar scalers (for benchmarking and debugging)
+void upscale_disable_simd();
+
+// How many destination pixels each source pixel becomes, across and down
+int upscale_factor(upscale_mode mode);
+
+// Converts a width x height frame of color codes like
+// pixfmt_convert_frame() into a frame upscale_factor(mode) times as wide
+// and as high. Pitches are in bytes.
+void upscale_convert_frame(upscale_mode mode, pixfmt fmt, const byte *src, int src_pitch, const byte *banks,
+                           void *dst, int dst_pitch, int width, int height);
+
+#endif
@@ -0,0 +1,33 @@
+#include "common.h"
+
+#ifndef VIDEO_STREAM_H
+#define VIDEO_STREAM_H
+
+#include <stddef.h>
+
+// Raw video formats for piping frames into an external encoder, e.g.
+//   ffmpeg -i - out.mkv                                      (Y4M)
+//   ffmpeg -f rawvideo -pix_fmt rgb24 -s 256x240 -r 60.0988 -i - out.mkv
+// Frames are the SCREEN_WIDTH x SCREEN_HEIGHT NES picture at the NTSC
+// frame rate.
+typedef enum {
+    VIDEO_STREAM_Y4M,     // YUV4MPEG2, 4:4:4, BT.601 limited range
+    VIDEO_STREAM_Y4M_420, // YUV4MPEG2, 4:2:0 (half the size of 4:4:4)
+    VIDEO_STREAM_RGB24    // R, G, B bytes, no headers
+} video_stream_format;
+
+// Builds the YUV palette from the pixfmt tables, call after pixfmt_init()
+void video_stream_init();
+
+// Stream header, written once before the first frame. Returns its length,
+// 0 for formats without one.
+int video_stream_header(video_stream_format format, char *out, int size);
+
+// Bytes each frame takes in the stream, frame header included
+size_t video_stream_frame_size(video_stream_format format);
+
+// Encodes a frame of color codes, each row with its emphasis bank (banks
+// may be NULL), into video_stream_frame_size(format) bytes at out
+void video_stream_encode(video_stream_format format, const byte *frame, const byte *banks, byte *out);
+
+#endif
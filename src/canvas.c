@@ -0,0 +1,109 @@
+/*
+Canvas composition for the backends that present a 320x240 canvas.
+
+The PPU has already put the backdrop wherever no layer covers the
+picture, so the borders are the only other place it goes. Canvases are
+drawn again and again (the YATCPU VRAM, the frame writer buffers, a
+reused archive payload), and their borders are only filled when the
+backdrop differs from the one they were last filled with.
+*/
+#include "canvas.h"
+
+static const uint32_t digits[16] = {
+  0x69999996,
+  0x22222222,
+  0x61168886,
+  0xE116111E,
+  0x99961111,
+  0x68861116,
+  0x68869996,
+  0x61111111,
+  0x69969996,
+  0x69961116,
+  0x69996999,
+  0xE99E999E,
+  0x78888887,
+  0xE999999E,
+  0x78868887,
+  0x78868888,
+};
+
+// Canvases drawn recently and the backdrop their borders hold
+static struct {
+    void *canvas;
+    int backdrop;
+} borders_drawn[CANVAS_BORDER_CACHE];
+static int borders_next;
+
+/* Whether the borders of a canvas have to be filled with the backdrop,
+   noting that they will be */
+static bool borders_stale(void *canvas, int backdrop) {
+    for (int i = 0; i < CANVAS_BORDER_CACHE; ++i) {
+        if (borders_drawn[i].canvas == canvas) {
+            bool stale = borders_drawn[i].backdrop != backdrop;
+            borders_drawn[i].backdrop = backdrop;
+            return stale;
+        }
+    }
+    borders_drawn[borders_next].canvas = canvas;
+    borders_drawn[borders_next].backdrop = backdrop;
+    borders_next = (borders_next + 1) % CANVAS_BORDER_CACHE;
+    return true;
+}
+
+static size_t fill_border(pixfmt fmt, void *row, int x, int backdrop) {
+    if (fmt == PIXFMT_XRGB8888) {
+        uint32_t *p = (uint32_t *) row + x, bgc = pixfmt_xrgb8888[0][backdrop];
+        for (int i = 0; i < CANVAS_X_OFFSET; ++i)
+            p[i] = bgc;
+    } else {
+        uint16_t *p = (uint16_t *) row + x, bgc = pixfmt_rgb565[0][backdrop];
+        for (int i = 0; i < CANVAS_X_OFFSET; ++i)
+            p[i] = bgc;
+    }
+    return CANVAS_X_OFFSET * pixfmt_bytes_per_pixel(fmt);
+}
+
+size_t canvas_convert_frame(pixfmt fmt, void *canvas, const byte *frame, const byte *emphasis, int backdrop) {
+    int bpp = pixfmt_bytes_per_pixel(fmt);
+    bool borders = borders_stale(canvas, backdrop);
+    size_t stored = 0;
+    for (int y = 0; y < CANVAS_HEIGHT; ++y) {
+        byte *row = (byte *) canvas + y * CANVAS_WIDTH * bpp;
+        if (borders)
+            stored += fill_border(fmt, row, 0, backdrop);
+        pixfmt_convert_line(fmt, frame + y * SCREEN_WIDTH, row + CANVAS_X_OFFSET * bpp, SCREEN_WIDTH, emphasis[y]);
+        stored += SCREEN_WIDTH * bpp;
+        if (borders)
+            stored += fill_border(fmt, row, CANVAS_X_OFFSET + SCREEN_WIDTH, backdrop);
+    }
+    return stored;
+}
+
+size_t canvas_draw_counter(pixfmt fmt, void *canvas, int x, int y, unsigned value) {
+    int bpp = pixfmt_bytes_per_pixel(fmt);
+    size_t stored = 0;
+    for (int i = 0; i < 8; ++i) {
+        uint32_t bits = digits[(value >> (i * 4)) & 0xF];
+        int left = x + (7 - i) * 5;
+        for (int h = 0; h < 8; ++h) {
+            for (int w = 0; w < 4; ++w) {
+                if (bits & (1 << ((7 - h) * 4 + (3 - w)))) {
+                    int at = (y + h) * CANVAS_WIDTH + (left + w);
+                    if (bpp == 4)
+                        ((uint32_t *) canvas)[at] = 0xFFFFFFFF;
+                    else
+                        ((uint16_t *) canvas)[at] = 0xFFFF;
+                    stored += bpp;
+                }
+            }
+        }
+    }
+    return stored;
+}
+
+size_t canvas_compose(pixfmt fmt, void *canvas, const byte *frame, const byte *emphasis, int backdrop,
+                      unsigned counter) {
+    return canvas_convert_frame(fmt, canvas, frame, emphasis, backdrop) +
+           canvas_draw_counter(fmt, canvas, CANVAS_X_OFFSET, 4, counter);
+}
@@ -16,7 +16,7 @@ byte op_code;             // Current instruction code
 int op_value, op_address; // Arguments for current instruction
 int op_cycles;            // Additional instruction cycles used (e.g. when paging occurs)
 
-unsigned long long cpu_cycles;  // Total CPU Cycles Since Power Up (wraps)
+unsigned long long cpu_cycles;  // Total CPU Cycles Since Power Up
 
 // CPU Memory
 
@@ -583,7 +583,7 @@ void cpu_run(long cycles)
             cpu_op_handler[op_code]();
         }
         cycles -= cpu_op_cycles[op_code] + op_cycles;
-        cpu_cycles -= cpu_op_cycles[op_code] + op_cycles;
+        cpu_cycles += cpu_op_cycles[op_code] + op_cycles;
         op_cycles = 0;
     }
 }
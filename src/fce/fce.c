@@ -5,8 +5,6 @@
 #include "hal.h"
 #include "nes.h"
 
-PixelBuf bg, bbg, fg;
-
 typedef struct {
     char signature[4];
     byte prg_block_count;
@@ -47,7 +45,8 @@ int fce_load_rom(char *prom)
         return -1;
     }
     rom += prg_size;
-    // Copying CHR pages into MMC and PPU
+    // Copying CHR pages into MMC and PPU. Without any the cart has 8 KiB
+    // of CHR-RAM instead, which the game fills through $2007.
     int i;
     for (i = 0; i < fce_rom_header.chr_block_count; i++) {
         mmc_append_chr_rom_page(rom);
@@ -66,7 +65,11 @@ void fce_init()
     nes_hal_init();
     cpu_init();
     ppu_init();
-    ppu_set_mirroring(fce_rom_header.rom_type & 1);
+    if (fce_rom_header.rom_type & 8)
+        ppu_set_mirroring(PPU_MIRRORING_FOUR_SCREEN);
+    else
+        ppu_set_mirroring(fce_rom_header.rom_type & 1);
+    ppu_set_chr_ram(fce_rom_header.chr_block_count == 0);
     cpu_reset();
 }
 
@@ -74,15 +77,31 @@ void wait_for_frame();
 
 void fce_run()
 {
-    while(1)
+    while (!nes_hal_done())
     {
         wait_for_frame();
-            int scanlines = 262;
-            while (scanlines-- > 0)
-            {
-                ppu_run(1);
-                cpu_run(1364 / 12); // 1 scanline
-            }
+        fce_run_frame();
+    }
+}
+
+void fce_run_frame()
+{
+    if (ppu_catches_up()) {
+        // The CPU runs on its own up to vblank and frame end, the PPU
+        // catches up there and whenever the CPU accesses it
+        unsigned long frame = ppu_frame_count();
+        while (ppu_frame_count() == frame) {
+            cpu_run(ppu_next_event_cycle() - cpu_clock());
+            ppu_catch_up();
+        }
+    }
+    else {
+        int scanlines = 262;
+        while (scanlines-- > 0)
+        {
+            ppu_run(1);
+            cpu_run(1364 / 12); // 1 scanline
+        }
     }
 }
 
@@ -91,22 +110,9 @@ void fce_run()
 
 void fce_update_screen()
 {
-    int idx = ppu_ram_read(0x3F00);
+    // Scanlines have already been flushed by the PPU as they were drawn
+    int idx = ppu_backdrop_color();
     nes_set_bg_color(idx);
-    
-    if (ppu_shows_sprites())
-        nes_flush_buf(&bbg);
-
-    if (ppu_shows_background())
-        nes_flush_buf(&bg);
-
-    if (ppu_shows_sprites())
-        nes_flush_buf(&fg);
-
     nes_flip_display();
-
-    pixbuf_clean(bbg);
-    pixbuf_clean(bg);
-    pixbuf_clean(fg);
 }
 
@@ -19,6 +19,7 @@ void memory_writeb(word address, byte data)
     // DMA transfer
     int i;
     if (address == 0x4014) {
+        ppu_sync();
         for (i = 0; i < 256; i++) {
             ppu_sprram_write(cpu_ram_read((0x100 * data) + i));
         }
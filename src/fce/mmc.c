@@ -19,7 +19,9 @@ extern inline void mmc_write(word address, byte data)
 {
     switch (mmc_id) {
         case 0x3: {
-            ppu_copy(0x0000, &mmc_chr_pages[data & 3][0], 0x2000);
+            // CHR-RAM has no banks to switch
+            if (mmc_chr_pages_number > 0)
+                ppu_copy(0x0000, &mmc_chr_pages[data & 3][0], 0x2000);
         }
         break;
     }
@@ -0,0 +1,634 @@
+/*
+Dot-accurate PPU, a drop-in replacement for ppu.c chosen at build time
+(LITENES_PPU_DOT in CMake, PPU=dot with make).
+
+The PPU steps one dot at a time, 341 per scanline and 262 scanlines per
+frame, with the background fetch pipeline and shift registers of the real
+chip, sprite evaluation into secondary OAM and per-sprite shifters. Writes
+in the middle of a scanline show from the dot they happen on. The CPU
+clock drives it: every register access first runs the PPU up to the
+current CPU cycle, so it always catches up (see ppu_set_catch_up).
+
+It is several times slower than the scanline PPU and has none of its
+renderer options: no frame cache, pipelining or band rendering.
+*/
+#include "ppu.h"
+#include "ppu-dot-internal.h"
+#include "cpu.h"
+#include "fce.h"
+#include "hal.h"
+
+byte PPU_SPRRAM[0x100];
+byte PPU_RAM[0x4000];
+
+// PPUCTRL Functions
+
+extern inline word ppu_base_nametable_address()                            { return 0x2000 | ((ppu.PPUCTRL & 0x3) << 10);            }
+extern inline byte ppu_vram_address_increment()                            { return common_bit_set(ppu.PPUCTRL, 2) ? 32 : 1;          }
+extern inline word ppu_sprite_pattern_table_address()                      { return common_bit_set(ppu.PPUCTRL, 3) ? 0x1000 : 0x0000; }
+extern inline word ppu_background_pattern_table_address()                  { return common_bit_set(ppu.PPUCTRL, 4) ? 0x1000 : 0x0000; }
+extern inline byte ppu_sprite_height()                                     { return common_bit_set(ppu.PPUCTRL, 5) ? 16 : 8;          }
+extern inline bool ppu_generates_nmi()                                     { return common_bit_set(ppu.PPUCTRL, 7);                   }
+
+
+
+// PPUMASK Functions
+
+extern inline bool ppu_renders_grayscale()                                 { return common_bit_set(ppu.PPUMASK, 0); }
+extern inline bool ppu_shows_background_in_leftmost_8px()                  { return common_bit_set(ppu.PPUMASK, 1); }
+extern inline bool ppu_shows_sprites_in_leftmost_8px()                     { return common_bit_set(ppu.PPUMASK, 2); }
+extern inline bool ppu_shows_background()                                  { return common_bit_set(ppu.PPUMASK, 3); }
+extern inline bool ppu_shows_sprites()                                     { return common_bit_set(ppu.PPUMASK, 4); }
+extern inline bool ppu_renders()                                           { return (ppu.PPUMASK & 0x18) != 0;      }
+
+
+
+// PPUSTATUS Functions
+
+extern inline bool ppu_sprite_overflow()                                   { return common_bit_set(ppu.PPUSTATUS, 5); }
+extern inline bool ppu_sprite_0_hit()                                      { return common_bit_set(ppu.PPUSTATUS, 6); }
+extern inline bool ppu_in_vblank()                                         { return common_bit_set(ppu.PPUSTATUS, 7); }
+
+extern inline void ppu_set_sprite_overflow(bool yesno)                     { common_modify_bitb(&ppu.PPUSTATUS, 5, yesno); }
+extern inline void ppu_set_sprite_0_hit(bool yesno)                        { common_modify_bitb(&ppu.PPUSTATUS, 6, yesno); }
+extern inline void ppu_set_in_vblank(bool yesno)                           { common_modify_bitb(&ppu.PPUSTATUS, 7, yesno); }
+
+
+
+// RAM
+
+extern inline byte ppu_ram_read(word address)
+{
+    address &= 0x3FFF;
+    if (address >= 0x3F00)
+        return PPU_RAM[0x3F00 | ppu_palette_offsets[address & 0x1F]];
+    return ppu_pages[address >> 10][address & 0x3FF];
+}
+
+extern inline void ppu_ram_write(word address, byte data)
+{
+    address &= 0x3FFF;
+    if (address < 0x2000 && !ppu.chr_ram)
+        return;
+    if (address >= 0x3F00)
+        PPU_RAM[0x3F00 | ppu_palette_offsets[address & 0x1F]] = data;
+    else
+        ppu_pages[address >> 10][address & 0x3FF] = data;
+}
+
+void ppu_set_mirroring(byte mirroring)
+{
+    int i;
+
+    ppu.mirroring = mirroring;
+    for (i = 0; i < 8; i++)
+        ppu_pages[i] = &PPU_RAM[i << 10];
+    for (i = 0; i < 8; i++)
+        ppu_pages[8 + i] = &PPU_RAM[0x2000 + (ppu_mirroring_pages[mirroring][i & 3] << 10)];
+}
+
+void ppu_set_chr_ram(bool yesno)
+{
+    ppu.chr_ram = yesno;
+}
+
+
+
+// Background Pipeline
+
+// Moves the fetched tile into the low byte of the shift registers
+void ppu_load_background_shifters()
+{
+    ppu_background_l = (ppu_background_l & 0xFF00) | ppu_next_pattern_l;
+    ppu_background_h = (ppu_background_h & 0xFF00) | ppu_next_pattern_h;
+    ppu_attribute_l = (ppu_attribute_l & 0xFF00) | ((ppu_next_attribute & 1) ? 0xFF : 0x00);
+    ppu_attribute_h = (ppu_attribute_h & 0xFF00) | ((ppu_next_attribute & 2) ? 0xFF : 0x00);
+}
+
+// Coarse X, which moves to the horizontally adjacent nametable after 31
+void ppu_increment_x()
+{
+    if ((ppu.v & 0x001F) == 31)
+        ppu.v = (ppu.v & ~0x001F) ^ 0x0400;
+    else
+        ppu.v++;
+}
+
+// Fine Y, then coarse Y, which moves to the other nametable after row 29
+void ppu_increment_y()
+{
+    if ((ppu.v & 0x7000) != 0x7000) {
+        ppu.v += 0x1000;
+        return;
+    }
+
+    int coarse_y = (ppu.v >> 5) & 31;
+    ppu.v &= ~0x7000;
+    if (coarse_y == 29) {
+        coarse_y = 0;
+        ppu.v ^= 0x0800;
+    }
+    else if (coarse_y == 31) {
+        coarse_y = 0;
+    }
+    else {
+        coarse_y++;
+    }
+    ppu.v = (ppu.v & ~0x03E0) | (coarse_y << 5);
+}
+
+// Tile fetches of dots 1 - 256 and 321 - 336, two dots per memory access,
+// with the shift registers moving one pixel per dot
+void ppu_fetch_background()
+{
+    int dot = ppu.dot;
+
+    if ((dot >= 2 && dot <= 257) || (dot >= 321 && dot <= 337)) {
+        ppu_background_l <<= 1;
+        ppu_background_h <<= 1;
+        ppu_attribute_l <<= 1;
+        ppu_attribute_h <<= 1;
+
+        word v = ppu.v;
+        switch ((dot - 1) & 7) {
+            case 0:
+                ppu_load_background_shifters();
+                ppu_next_tile = ppu_ram_read(0x2000 | (v & 0x0FFF));
+                break;
+            case 2:
+            {
+                byte attribute = ppu_ram_read(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+                if (v & 0x0040)
+                    attribute >>= 4;
+                if (v & 0x0002)
+                    attribute >>= 2;
+                ppu_next_attribute = attribute & 3;
+                break;
+            }
+            case 4:
+                ppu_next_pattern_l = ppu_ram_read(ppu_background_pattern_table_address() + 16 * ppu_next_tile + (v >> 12));
+                break;
+            case 6:
+                ppu_next_pattern_h = ppu_ram_read(ppu_background_pattern_table_address() + 16 * ppu_next_tile + (v >> 12) + 8);
+                break;
+            case 7:
+                ppu_increment_x();
+                break;
+        }
+    }
+
+    if (dot == 256) {
+        ppu_increment_y();
+    }
+    else if (dot == 257) {
+        ppu_load_background_shifters();
+        ppu.v = (ppu.v & ~0x041F) | (ppu.t & 0x041F);
+    }
+    else if (ppu.scanline == -1 && dot >= 280 && dot <= 304) {
+        ppu.v = (ppu.v & ~0x7BE0) | (ppu.t & 0x7BE0);
+    }
+}
+
+
+
+// Sprite Pipeline
+
+// Fills secondary OAM with the sprites of the next scanline. A sprite at
+// OAM y shows up on scanlines y + 1 to y + height.
+void ppu_evaluate_sprites()
+{
+    byte height = ppu_sprite_height();
+    int n;
+
+    ppu_secondary_count = 0;
+    ppu_secondary_has_sprite_0 = false;
+    if (ppu.scanline < 0)
+        return;
+
+    for (n = 0; n < 64; n++) {
+        int row = ppu.scanline - PPU_SPRRAM[n << 2];
+        if (row < 0 || row >= height)
+            continue;
+
+        if (ppu_secondary_count == 8) {
+            ppu_set_sprite_overflow(true);
+            if (ppu_sprite_limit)
+                break;
+        }
+        memcpy(ppu_secondary_oam[ppu_secondary_count++], &PPU_SPRRAM[n << 2], 4);
+        if (n == 0)
+            ppu_secondary_has_sprite_0 = true;
+    }
+}
+
+// Loads the shifters of sprite i of secondary OAM for the next scanline
+void ppu_fetch_sprite(int i)
+{
+    const byte *sprite = ppu_secondary_oam[i];
+    byte height = ppu_sprite_height();
+    byte attr = sprite[2];
+    int row = ppu.scanline - sprite[0];
+
+    if (attr & 0x80)
+        row = height - 1 - row;
+
+    word address;
+    if (height == 16) {
+        // 8x16 sprites pick the pattern table with bit 0 of the tile index
+        address = ((sprite[1] & 1) ? 0x1000 : 0x0000) + 16 * (sprite[1] & 0xFE) + (row & 7) + ((row & 8) << 1);
+    }
+    else {
+        address = ppu_sprite_pattern_table_address() + 16 * sprite[1] + row;
+    }
+
+    byte l = ppu_ram_read(address);
+    byte h = ppu_ram_read(address + 8);
+    if (attr & 0x40) {
+        l = ppu_bit_reverse_table[l];
+        h = ppu_bit_reverse_table[h];
+    }
+    ppu_sprite_l[i] = l;
+    ppu_sprite_h[i] = h;
+    ppu_sprite_attr[i] = attr;
+    ppu_sprite_x[i] = sprite[3];
+}
+
+// Sprites wait for their X counter to run out, then shift out one pixel per dot
+void ppu_shift_sprites()
+{
+    int i;
+    for (i = 0; i < ppu_sprite_count; i++) {
+        if (ppu_sprite_x[i] > 0) {
+            ppu_sprite_x[i]--;
+        }
+        else {
+            ppu_sprite_l[i] <<= 1;
+            ppu_sprite_h[i] <<= 1;
+        }
+    }
+}
+
+
+
+// Output
+
+// Pixel dot - 1 of the current scanline, from both pipelines
+void ppu_render_pixel()
+{
+    int x = ppu.dot - 1;
+    byte background = 0, sprite = 0;
+    bool behind = false;
+    int i;
+
+    if (ppu_shows_background() && (x >= 8 || ppu_shows_background_in_leftmost_8px())) {
+        word bit = 0x8000 >> ppu.fine_x;
+        byte color = ((ppu_background_h & bit) ? 2 : 0) | ((ppu_background_l & bit) ? 1 : 0);
+        if (color != 0)
+            background = ((ppu_attribute_h & bit) ? 8 : 0) | ((ppu_attribute_l & bit) ? 4 : 0) | color;
+    }
+
+    // The first opaque sprite in OAM order wins, priority bit included
+    if (ppu_shows_sprites() && (x >= 8 || ppu_shows_sprites_in_leftmost_8px())) {
+        for (i = 0; i < ppu_sprite_count; i++) {
+            if (ppu_sprite_x[i] != 0)
+                continue;
+
+            byte color = ((ppu_sprite_h[i] >> 6) & 2) | (ppu_sprite_l[i] >> 7);
+            if (color == 0)
+                continue;
+
+            if (i == 0 && ppu_sprite_0_loaded && background != 0 && x != 255)
+                ppu_set_sprite_0_hit(true);
+            sprite = 0x10 | ((ppu_sprite_attr[i] & 3) << 2) | color;
+            behind = ppu_sprite_attr[i] & 0x20;
+            break;
+        }
+    }
+
+    byte offset = background;
+    if (sprite != 0 && (background == 0 || !behind))
+        offset = sprite;
+    ppu_line[x] = PPU_RAM[0x3F00 | ppu_palette_offsets[offset]] & (ppu_renders_grayscale() ? 0x30 : 0x3F);
+}
+
+// Decides whether the frame starting now is drawn
+void ppu_start_frame()
+{
+    if (ppu_skip_frames == PPU_SKIP_ALL_FRAMES) {
+        ppu_frame_skipped = true;
+    }
+    else if (ppu_skip_countdown > 0) {
+        ppu_skip_countdown--;
+        ppu_frame_skipped = true;
+    }
+    else {
+        ppu_skip_countdown = ppu_skip_frames;
+        ppu_frame_skipped = false;
+    }
+}
+
+void ppu_set_frame_skip(int skip)
+{
+    ppu_skip_frames = skip < 0 ? PPU_SKIP_ALL_FRAMES : skip;
+    // A frame being drawn is the first of its group, so that the ratio
+    // holds from power-up, where no frame has started yet
+    ppu_skip_countdown = ppu_frame_skipped || skip < 0 ? 0 : skip;
+}
+
+int ppu_frame_skip()
+{
+    return ppu_skip_frames;
+}
+
+byte ppu_backdrop_color()
+{
+    return PPU_RAM[0x3F00];
+}
+
+// The scanline PPU's renderer options, which don't apply here
+
+void ppu_set_pipelined(bool yesno)                                          { (void) yesno;  }
+void ppu_render_packet(ppu_frame_packet *packet)                            { (void) packet; }
+bool ppu_prepare_bands(ppu_frame_packet *packet)                            { (void) packet; return false; }
+void ppu_render_band(ppu_frame_packet *packet, int band, int bands)         { (void) packet; (void) band; (void) bands; }
+void ppu_finish_bands(ppu_frame_packet *packet)                             { (void) packet; }
+void ppu_set_frame_cache(bool yesno)                                        { (void) yesno;  }
+
+ppu_frame_cache_stats ppu_get_frame_cache_stats()
+{
+    ppu_frame_cache_stats stats = { 0, 0, 0, 0 };
+    return stats;
+}
+
+
+
+// PPU Lifecycle
+
+void ppu_step()
+{
+    int scanline = ppu.scanline;
+    int dot = ppu.dot;
+    bool rendering = ppu_renders();
+
+    if (scanline < 240) {
+        if (rendering) {
+            ppu_fetch_background();
+
+            // Secondary OAM is filled by dot 256, the sprites' patterns are
+            // fetched in dots 257 - 320, one sprite per 8 dots (past the
+            // eighth, all at the end)
+            if (dot == 257) {
+                ppu_evaluate_sprites();
+                ppu_sprite_count = ppu_secondary_count;
+                ppu_sprite_0_loaded = ppu_secondary_has_sprite_0;
+            }
+            if (dot >= 257 && dot <= 320 && ((dot - 257) & 7) == 7) {
+                int i = (dot - 257) >> 3;
+                if (i < ppu_sprite_count)
+                    ppu_fetch_sprite(i);
+                if (dot == 320)
+                    for (i = 8; i < ppu_sprite_count; i++)
+                        ppu_fetch_sprite(i);
+            }
+        }
+        else if (dot == 257) {
+            ppu_sprite_count = 0;
+        }
+
+        if (scanline >= 0 && dot >= 1 && dot <= 256) {
+            ppu_render_pixel();
+            if (rendering)
+                ppu_shift_sprites();
+            if (dot == 256 && !ppu_frame_skipped)
+                nes_flush_scanline(scanline, ppu_line, ppu.PPUMASK >> 5);
+        }
+        else if (scanline == -1 && dot == 1) {
+            ppu_set_in_vblank(false);
+            ppu_set_sprite_0_hit(false);
+            ppu_set_sprite_overflow(false);
+        }
+    }
+    else if (scanline == 241 && dot == 1) {
+        ppu_set_in_vblank(true);
+        if (ppu_generates_nmi())
+            ppu_nmi_pending = true;
+    }
+
+    // Odd frames skip the last dot of the pre-render scanline while rendering
+    if (scanline == -1 && dot == 339 && rendering && ppu.odd_frame)
+        dot++;
+
+    if (++dot < PPU_DOTS_PER_SCANLINE) {
+        ppu.dot = dot;
+        return;
+    }
+
+    ppu.dot = 0;
+    if (++ppu.scanline == PPU_SCANLINES_PER_FRAME - 1) {
+        if (!ppu_frame_skipped)
+            fce_update_screen();
+        ppu.scanline = -1;
+        ppu.odd_frame = !ppu.odd_frame;
+        ppu_frames++;
+        ppu_start_frame();
+    }
+}
+
+// Runs one scanline ahead of the CPU. Like ppu_catch_up(), raises a vblank
+// NMI that came due.
+void ppu_cycle()
+{
+    do {
+        ppu_step();
+        ppu_dot_clock++;
+    } while (ppu.dot != 0);
+
+    if (ppu_nmi_pending) {
+        ppu_nmi_pending = false;
+        cpu_interrupt();
+    }
+}
+
+void ppu_run(int cycles)
+{
+    while (cycles-- > 0)
+        ppu_cycle();
+}
+
+unsigned long ppu_frame_count()
+{
+    return ppu_frames;
+}
+
+
+
+// Catch-up Mode
+
+// Always on, the PPU is only ever run up to the CPU clock
+void ppu_set_catch_up(bool yesno)
+{
+    (void) yesno;
+}
+
+bool ppu_catches_up()
+{
+    return true;
+}
+
+// Runs every dot that started before the current CPU cycle
+void ppu_sync()
+{
+    unsigned long long now = cpu_clock() * 3;
+    while (ppu_dot_clock < now) {
+        ppu_step();
+        ppu_dot_clock++;
+    }
+}
+
+void ppu_catch_up()
+{
+    ppu_sync();
+    if (ppu_nmi_pending) {
+        ppu_nmi_pending = false;
+        cpu_interrupt();
+    }
+}
+
+unsigned long long ppu_next_event_cycle()
+{
+    // Dots to go until the dot after vblank starts, or the frame ends
+    int position = (ppu.scanline + 1) * PPU_DOTS_PER_SCANLINE + ppu.dot;
+    int vblank = 242 * PPU_DOTS_PER_SCANLINE + 2;
+    int target = position < vblank ? vblank : PPU_SCANLINES_PER_FRAME * PPU_DOTS_PER_SCANLINE;
+    return (ppu_dot_clock + (target - position) + 2) / 3;
+}
+
+
+
+extern inline void ppu_copy(word address, byte *source, int length)
+{
+    // Dots before a CHR bank switch are drawn with the old tiles
+    ppu_sync();
+    memcpy(&PPU_RAM[address], source, length);
+}
+
+extern inline byte ppu_io_read(word address)
+{
+    ppu_sync();
+    switch (address & 7) {
+        case 2:
+        {
+            byte value = (ppu.PPUSTATUS & 0xE0) | (ppu_latch & 0x1F);
+            ppu_set_in_vblank(false);
+            ppu.w = 0;
+            ppu.first_data_read = true;
+            return ppu_latch = value;
+        }
+        case 4: return ppu_latch = PPU_SPRRAM[ppu.OAMADDR];
+        case 7:
+        {
+            // The CPU core reads the operand of every absolute store too, so
+            // v moves on here rather than on writes, as in ppu.c. Skipping
+            // the first read after $2006 stands in for the read buffer.
+            byte data = ppu_latch = ppu_ram_read(ppu.v);
+            if (ppu.first_data_read)
+                ppu.first_data_read = false;
+            else
+                ppu.v = (ppu.v + ppu_vram_address_increment()) & 0x7FFF;
+            return data;
+        }
+        default:
+            return ppu_latch;
+    }
+}
+
+extern inline void ppu_io_write(word address, byte data)
+{
+    ppu_sync();
+    if (!ppu.ready && cpu_clock() > 29658)
+        ppu.ready = true;
+
+    address &= 7;
+    ppu_latch = data;
+    switch(address) {
+        case 0:
+        {
+            if (!ppu.ready)
+                return;
+
+            ppu.PPUCTRL = data;
+            ppu.t = (ppu.t & ~0x0C00) | ((data & 0x3) << 10);
+            break;
+        }
+        case 1:
+        {
+            if (!ppu.ready)
+                return;
+
+            ppu.PPUMASK = data;
+            break;
+        }
+        case 3: ppu.OAMADDR = data; break;
+        case 4: ppu_sprram_write(data); break;
+        case 5:
+        {
+            if (ppu.w) {
+                ppu.t = (ppu.t & ~0x73E0) | ((data & 0x07) << 12) | ((data & 0xF8) << 2);
+            }
+            else {
+                ppu.t = (ppu.t & ~0x001F) | (data >> 3);
+                ppu.fine_x = data & 0x07;
+            }
+
+            ppu.w ^= 1;
+            break;
+        }
+        case 6:
+        {
+            if (!ppu.ready)
+                return;
+
+            if (ppu.w) {
+                ppu.t = (ppu.t & 0xFF00) | data;
+                ppu.v = ppu.t;
+            }
+            else {
+                ppu.t = (ppu.t & 0x00FF) | ((data & 0x3F) << 8);
+            }
+
+            ppu.w ^= 1;
+            ppu.first_data_read = true;
+            break;
+        }
+        case 7: ppu_ram_write(ppu.v, data); break;
+    }
+}
+
+void ppu_init()
+{
+    int l, x;
+
+    ppu.PPUCTRL = ppu.PPUMASK = ppu.PPUSTATUS = ppu.OAMADDR = 0;
+    ppu.v = ppu.t = ppu.fine_x = ppu.w = 0;
+    ppu.PPUSTATUS |= 0xA0;
+    ppu.first_data_read = true;
+    ppu.scanline = ppu.dot = 0;
+    ppu_dot_clock = cpu_clock() * 3;
+    ppu_set_mirroring(PPU_MIRRORING_HORIZONTAL);
+
+    for (l = 0; l < 0x100; l++) {
+        ppu_bit_reverse_table[l] = 0;
+        for (x = 0; x < 8; x++)
+            ppu_bit_reverse_table[l] |= ((l >> x) & 1) << (7 - x);
+    }
+}
+
+void ppu_sprram_write(byte data)
+{
+    PPU_SPRRAM[ppu.OAMADDR++] = data;
+}
+
+void ppu_set_sprite_limit(bool yesno)
+{
+    ppu_sprite_limit = yesno;
+}
@@ -10,7 +10,6 @@
 
 byte ppu_sprite_palette[4][4];
 bool ppu_2007_first_read;
-byte ppu_addr_latch;
 
 byte PPU_SPRRAM[0x100];
 byte PPU_RAM[0x4000];
@@ -60,39 +59,66 @@ extern inline void ppu_set_in_vblank(bool yesno)                           { com
 
 
 
+// Render State Functions
+
+extern inline word ppu_render_sprite_pattern_table_address()               { return common_bit_set(ppu_render.ctrl, 3) ? 0x1000 : 0x0000; }
+extern inline word ppu_render_background_pattern_table_address()           { return common_bit_set(ppu_render.ctrl, 4) ? 0x1000 : 0x0000; }
+extern inline byte ppu_render_sprite_height()                              { return common_bit_set(ppu_render.ctrl, 5) ? 16 : 8;          }
+extern inline bool ppu_render_shows_background_in_leftmost_8px()           { return common_bit_set(ppu_render.mask, 1); }
+extern inline bool ppu_render_shows_sprites_in_leftmost_8px()              { return common_bit_set(ppu_render.mask, 2); }
+extern inline bool ppu_render_shows_background()                           { return common_bit_set(ppu_render.mask, 3); }
+extern inline bool ppu_render_shows_sprites()                              { return common_bit_set(ppu_render.mask, 4); }
+extern inline bool ppu_render_renders_grayscale()                          { return common_bit_set(ppu_render.mask, 0); }
+
+
+
 // RAM
 
-extern inline word ppu_get_real_ram_address(word address)
+// Every access is one page lookup, or one palette offset lookup
+extern inline byte ppu_ram_read(word address)
 {
-    if (address < 0x2000) {
-        return address;
-    }
-    else if (address < 0x3F00) {
-        if (address < 0x3000) {
-            return address;
-        }
-        else {
-            return address;// - 0x1000;
-        }
-    }
-    else if (address < 0x4000) {
-        address = 0x3F00 | (address & 0x1F);
-        if (address == 0x3F10 || address == 0x3F14 || address == 0x3F18 || address == 0x3F1C)
-            return address - 0x10;
-        else
-            return address;
+    address &= 0x3FFF;
+    if (address >= 0x3F00)
+        return PPU_RAM[0x3F00 | ppu_palette_offsets[address & 0x1F]];
+    return ppu_pages[address >> 10][address & 0x3FF];
+}
+
+extern inline void ppu_ram_write(word address, byte data)
+{
+    address &= 0x3FFF;
+    byte *cell;
+    if (address < 0x2000 && !ppu.chr_ram)
+        return;
+    if (address >= 0x3F00)
+        cell = &PPU_RAM[0x3F00 | ppu_palette_offsets[address & 0x1F]];
+    else
+        cell = &ppu_pages[address >> 10][address & 0x3FF];
+
+    if (*cell != data) {
+        *cell = data;
+        ppu_emit(PPU_EVENT_VRAM, data, cell - PPU_RAM);
     }
-    return 0xFFFF;
 }
 
-extern inline byte ppu_ram_read(word address)
+void ppu_set_mirroring(byte mirroring)
 {
-    return PPU_RAM[ppu_get_real_ram_address(address)];
+    int i;
+
+    ppu.mirroring = mirroring;
+    for (i = 0; i < 4; i++)
+        ppu_nametable_page[i] = ppu_mirroring_pages[mirroring][i];
+
+    for (i = 0; i < 8; i++)
+        ppu_pages[i] = &PPU_RAM[i << 10];
+    for (i = 0; i < 8; i++)
+        ppu_pages[8 + i] = &PPU_RAM[0x2000 + (ppu_nametable_page[i & 3] << 10)];
+
+    ppu_emit(PPU_EVENT_MIRRORING, mirroring, 0);
 }
 
-extern inline void ppu_ram_write(word address, byte data)
+void ppu_set_chr_ram(bool yesno)
 {
-    PPU_RAM[ppu_get_real_ram_address(address)] = data;
+    ppu.chr_ram = yesno;
 }
 
 
@@ -129,110 +155,692 @@ extern inline void ppu_ram_write(word address, byte data)
 // 3F20 = 2B (00101011)
 
 
-// Rendering
+// CHR Tracking
+
+void ppu_chr_write(word address)
+{
+    int tile = address >> 4;
+    ppu_chr_dirty[tile >> 5] |= 1u << (tile & 31);
+    ppu_chr_dirty_any = true;
+}
+
+void ppu_chr_clear_dirty()
+{
+    int i;
+    for (i = 0; i < 16; i++)
+        ppu_chr_dirty[i] = 0;
+    ppu_chr_dirty_any = false;
+}
+
+
+
+// Nametable Cache
+
+// Marks the cells depending on a PPU_RAM offset for re-rendering
+void ppu_nametable_cache_write(word address)
+{
+    if (address >= 0x3000)
+        return;
+
+    int page = (address >> 10) & 3;
+    int offset = address & 0x3FF;
+    if (offset < 0x3C0) {
+        ppu_nametable_dirty[page][offset >> 5] |= 1u << (offset & 31);
+    }
+    else {
+        // One attribute byte covers 4x4 cells
+        int tile_y = ((offset - 0x3C0) >> 3) << 2;
+        int tile_x = ((offset - 0x3C0) & 7) << 2;
+        int row;
+        for (row = tile_y; row < tile_y + 4 && row < 30; row++)
+            ppu_nametable_dirty[page][row] |= 0xFu << tile_x;
+    }
+}
+
+void ppu_nametable_cache_invalidate()
+{
+    int page, row;
+    for (page = 0; page < 4; page++)
+        for (row = 0; row < 30; row++)
+            ppu_nametable_dirty[page][row] = 0xFFFFFFFF;
+    ppu_chr_clear_dirty();
+}
+
+// Marks the cells of every page that show a tile of the cached pattern
+// table written since the last call. Writes to the other pattern table
+// need nothing, switching tables renders everything again.
+void ppu_nametable_cache_sync_chr()
+{
+    const dword *dirty = &ppu_chr_dirty[ppu_nametable_pattern_table >> 9];
+    int page, cell, i;
 
-void ppu_draw_background_scanline(bool mirror)
+    for (i = 0; i < 8; i++)
+        if (dirty[i])
+            break;
+
+    for (page = 0; i < 8 && page < 4; page++) {
+        const byte *nametable = &ppu_render_ram[0x2000 + (page << 10)];
+        for (cell = 0; cell < 960; cell++) {
+            byte tile = nametable[cell];
+            if (dirty[tile >> 5] & (1u << (tile & 31)))
+                ppu_nametable_dirty[page][cell >> 5] |= 1u << (cell & 31);
+        }
+    }
+    ppu_chr_clear_dirty();
+}
+
+// Marks whatever the cache no longer shows right: everything after a
+// pattern table switch, the cells of written tiles otherwise
+void ppu_nametable_cache_validate()
+{
+    if (ppu_nametable_pattern_table != ppu_render_background_pattern_table_address()) {
+        ppu_nametable_pattern_table = ppu_render_background_pattern_table_address();
+        ppu_nametable_cache_invalidate();
+    }
+    else if (ppu_chr_dirty_any) {
+        ppu_nametable_cache_sync_chr();
+    }
+}
+
+// Renders the dirty cells of one row of tiles
+void ppu_nametable_cache_refresh(int page, int tile_y)
 {
+    dword dirty = ppu_nametable_dirty[page][tile_y];
+    const byte *nametable = &ppu_render_ram[0x2000 + (page << 10)];
     int tile_x;
-    for (tile_x = ppu_shows_background_in_leftmost_8px() ? 0 : 1; tile_x < 32; tile_x++) {
-        // Skipping off-screen pixels
-        if (((tile_x << 3) - ppu.PPUSCROLL_X + (mirror ? 256 : 0)) > 256)
+
+    for (tile_x = 0; dirty; tile_x++, dirty >>= 1) {
+        if (!(dirty & 1))
             continue;
 
-        int tile_y = ppu.scanline >> 3;
-        int tile_index = ppu_ram_read(ppu_base_nametable_address() + tile_x + (tile_y << 5) + (mirror ? 0x400 : 0));
-        word tile_address = ppu_background_pattern_table_address() + 16 * tile_index;
+        int tile_index = nametable[tile_x + (tile_y << 5)];
+        word tile_address = ppu_nametable_pattern_table + 16 * tile_index;
+
+        byte palette_attribute = nametable[0x3C0 + (tile_x >> 2) + (tile_y >> 2) * 8];
+        palette_attribute = ((palette_attribute >> (((tile_y & 2) << 1) | (tile_x & 2))) & 3) << 2;
+
+        // Pattern tables are below $2000 and never mirrored
+        const byte *pattern = &ppu_render_ram[tile_address & 0x1FF0];
+        int y_in_tile;
+        for (y_in_tile = 0; y_in_tile < 8; y_in_tile++) {
+            int y = (tile_y << 3) + y_in_tile;
+            byte l = pattern[y_in_tile];
+            byte h = pattern[y_in_tile + 8];
+            byte *pixels = &ppu_nametable_pixels[page][y][tile_x << 3];
+            int x;
+            for (x = 0; x < 8; x++)
+                pixels[x] = palette_attribute | PLA(l,h,x);
+        }
+    }
+    ppu_nametable_dirty[page][tile_y] = 0;
+}
+
+// Brings a row of tiles of both nametables of a scanline up to date
+void ppu_nametable_cache_prepare(const int *pages, int tile_y)
+{
+    ppu_nametable_cache_validate();
+    if (ppu_nametable_dirty[pages[0]][tile_y])
+        ppu_nametable_cache_refresh(pages[0], tile_y);
+    if (ppu_nametable_dirty[pages[1]][tile_y])
+        ppu_nametable_cache_refresh(pages[1], tile_y);
+}
+
+
+
+// Rendering
+
+// Background pixels x0 to x1 - 1 of the scanline v points at, copied out
+// of the cached nametables. Pixel x shows column (origin + x) & 511 of v's
+// nametable and its horizontal neighbour side by side.
+void ppu_draw_background_span(int x0, int x1, int origin)
+{
+    word v = ppu_render.v;
+    int y = ((v >> 2) & 0xF8) | (v >> 12);
+    int n = (v >> 10) & 3;
+    int pages[2] = { ppu_render_nametable_page[n], ppu_render_nametable_page[n ^ 1] };
+
+    // Coarse Y 30 and 31 would fetch attribute bytes as tiles
+    if (y >= PPU_SCANLINES) {
+        for (; x0 < x1; x0++)
+            ppu_background_line[x0] = 0;
+        return;
+    }
+
+    ppu_nametable_cache_prepare(pages, y >> 3);
+    while (x0 < x1) {
+        int column = (origin + x0) & 511;
+        int length = 256 - (column & 255);
+        if (length > x1 - x0)
+            length = x1 - x0;
+        memcpy(&ppu_background_line[x0], &ppu_nametable_pixels[pages[column >> 8]][y][column & 255], length);
+        x0 += length;
+    }
+}
+
+void ppu_evaluate_sprites()
+{
+    byte height = ppu_render_sprite_height();
+    int n, s;
+
+    for (s = 0; s < PPU_SCANLINES; s++)
+        ppu_scanline_sprite_count[s] = 0;
+
+    for (n = 0; n < 64; n++) {
+        ppu_oam_y[n]    = ppu_render_sprram[(n << 2)];
+        ppu_oam_tile[n] = ppu_render_sprram[(n << 2) + 1];
+        ppu_oam_attr[n] = ppu_render_sprram[(n << 2) + 2];
+        ppu_oam_x[n]    = ppu_render_sprram[(n << 2) + 3];
+
+        int last = ppu_oam_y[n] + height;
+        if (last >= PPU_SCANLINES)
+            last = PPU_SCANLINES - 1;
+
+        for (s = ppu_oam_y[n] + 1; s <= last; s++) {
+            // PPU can't render > 8 sprites
+            if (ppu_sprite_limit && ppu_scanline_sprite_count[s] >= 8)
+                continue;
+            ppu_scanline_sprites[s][ppu_scanline_sprite_count[s]++] = n;
+        }
+    }
+
+    ppu_oam_sprite_height = height;
+    ppu_oam_dirty = false;
+}
+
+// Pattern row of a sprite, row pixels below its top edge
+word ppu_sprite_row_address(byte tile, byte attr, int row, byte height, word pattern_table)
+{
+    if (attr & 0x80)
+        row = height - 1 - row;
+
+    word tile_address;
+    if (height == 16) {
+        // 8x16 sprites pick the pattern table with bit 0 of the tile index
+        tile_address = ((tile & 1) ? 0x1000 : 0x0000) + 16 * (tile & 0xFE);
+        if (row >= 8) {
+            tile_address += 16;
+            row -= 8;
+        }
+    }
+    else {
+        tile_address = pattern_table + 16 * tile;
+    }
+    return tile_address + (row & 0x7);
+}
+
+// Pattern bytes of sprite n on the scanline being drawn
+void ppu_fetch_sprite_row(int n, byte *l, byte *h)
+{
+    word address = ppu_sprite_row_address(ppu_oam_tile[n], ppu_oam_attr[n], ppu_render_scanline - ppu_oam_y[n] - 1,
+                                          ppu_oam_sprite_height, ppu_render_sprite_pattern_table_address());
+    *l = ppu_render_ram[address & 0x1FFF];
+    *h = ppu_render_ram[(address + 8) & 0x1FFF];
+}
+
+void ppu_draw_sprite_scanline()
+{
+    if (ppu_oam_dirty || ppu_oam_sprite_height != ppu_render_sprite_height())
+        ppu_evaluate_sprites();
+
+    const byte *sprites = ppu_scanline_sprites[ppu_render_scanline];
+    int count = ppu_scanline_sprite_count[ppu_render_scanline];
+    int i;
 
-        int y_in_tile = ppu.scanline & 0x7;
-        byte l = ppu_ram_read(tile_address + y_in_tile);
-        byte h = ppu_ram_read(tile_address + y_in_tile + 8);
+    // Sprites are visited in OAM order and never overwrite an opaque
+    // pixel, so the lowest-index sprite wins, priority bit included.
+    for (i = 0; i < count; i++) {
+        int n = sprites[i];
+        byte sprite_x = ppu_oam_x[n];
+        byte attr = ppu_oam_attr[n];
+        byte l, h;
+        ppu_fetch_sprite_row(n, &l, &h);
 
+        byte value = 0x10 | ((attr & 0x3) << 2) | ((attr & 0x20) ? PPU_SPRITE_BEHIND_BACKGROUND : 0);
         int x;
         for (x = 0; x < 8; x++) {
-            byte color = PLA(l,h,x);
+            int screen_x = sprite_x + x;
+            if (screen_x > 255)
+                break;
+            if (ppu_sprite_line[screen_x] != 0)
+                continue;
+
+            int color = (attr & 0x40) ? PLAF(l,h,x) : PLA(l,h,x);
 
             // Color 0 is transparent
-            if (color != 0) {
-                
-                word attribute_address = (ppu_base_nametable_address() + (mirror ? 0x400 : 0) + 0x3C0 + (tile_x >> 2) + (ppu.scanline >> 5) * 8);
-                bool top = (ppu.scanline % 32) < 16;
-                bool left = (tile_x % 4 < 2);
-
-                byte palette_attribute = ppu_ram_read(attribute_address);
-
-                if (!top) {
-                    palette_attribute >>= 4;
-                }
-                if (!left) {
-                    palette_attribute >>= 2;
-                }
-                palette_attribute &= 3;
-
-                word palette_address = 0x3F00 + (palette_attribute << 2);
-                int idx = ppu_ram_read(palette_address + color);
-
-                ppu_screen_background[(tile_x << 3) + x][ppu.scanline] = color;
-                
-                pixbuf_add(bg, (tile_x << 3) + x - ppu.PPUSCROLL_X + (mirror ? 256 : 0), ppu.scanline + 1, idx);
-            }
+            if (color != 0)
+                ppu_sprite_line[screen_x] = value | color;
         }
     }
 }
 
-void ppu_draw_sprite_scanline()
+// Merges pixels x0 to x1 - 1 of the background and sprite lines into
+// color codes. Grayscale is part of the palette lookup.
+void ppu_compose_span(int x0, int x1)
+{
+    byte gray = ppu_render_renders_grayscale() ? 0x30 : 0x3F;
+    byte palette[32];
+    int i;
+
+    // Transparent pixels of both layers end up at offset 0, the backdrop
+    for (i = 0; i < 32; i++)
+        palette[i] = ppu_render_ram[0x3F00 | ppu_palette_offsets[i]] & gray;
+
+    for (i = x0; i < x1; i++) {
+        byte background = ppu_background_line[i];
+        byte sprite = ppu_sprite_line[i];
+        byte offset = (background & 3) ? background : 0;
+
+        if (sprite != 0 && (offset == 0 || !(sprite & PPU_SPRITE_BEHIND_BACKGROUND)))
+            offset = sprite & 0x1F;
+
+        ppu_color_line[i] = palette[offset];
+    }
+}
+
+// Pixels x0 to x1 - 1 of both layers with the current render state
+void ppu_draw_span(int x0, int x1, int origin)
 {
-    int scanline_sprite_count = 0;
-    int n;
-    for (n = 0; n < 0x100; n += 4) {
-        byte sprite_x = PPU_SPRRAM[n + 3];
-        byte sprite_y = PPU_SPRRAM[n];
+    int x;
 
-        // Skip if sprite not on scanline
-        if (sprite_y > ppu.scanline || sprite_y + ppu_sprite_height() < ppu.scanline)
-           continue;
+    if (ppu_render_shows_background())
+        ppu_draw_background_span(x0, x1, origin);
+    else
+        for (x = x0; x < x1; x++)
+            ppu_background_line[x] = 0;
 
-        scanline_sprite_count++;
+    if (!ppu_render_shows_sprites())
+        for (x = x0; x < x1; x++)
+            ppu_sprite_line[x] = 0;
+
+    for (x = x0; x < x1 && x < 8; x++) {
+        if (!ppu_render_shows_background_in_leftmost_8px())
+            ppu_background_line[x] = 0;
+        if (!ppu_render_shows_sprites_in_leftmost_8px())
+            ppu_sprite_line[x] = 0;
+    }
+
+    ppu_compose_span(x0, x1);
+}
+
+// Applies a logged write from pixel x on, returns the new column origin
+int ppu_apply_log_entry(const ppu_log_entry *entry, int x, int origin)
+{
+    switch (entry->reg) {
+        case PPU_LOG_CTRL: ppu_render.ctrl = entry->value; break;
+        case PPU_LOG_MASK: ppu_render.mask = entry->value; break;
+        case PPU_LOG_FINE_X:
+            origin += entry->value - ppu_render.fine_x;
+            ppu_render.fine_x = entry->value;
+            break;
+        case PPU_LOG_V:
+            // The next tile fetched is the one v points at now
+            ppu_render.v = entry->value;
+            origin = ((entry->value & 31) << 3) + ppu_render.fine_x - x;
+            break;
+    }
+    return origin;
+}
+
+// Draws a scanline that has ended, in spans between the register writes
+// logged on it, and hands it to the HAL. Color emphasis applies to whole
+// scanlines, with the value it had when the scanline started.
+void ppu_draw_scanline(int scanline)
+{
+    const ppu_frame_packet *packet = ppu_rendered_packet;
+    bool split = ppu_log_read < packet->log_count && packet->log[ppu_log_read].scanline == scanline;
+    int x = 0, i;
+
+    ppu_render_scanline = scanline;
+    ppu_render = packet->line_state[scanline];
+    if (ppu_frame_cache_enabled && ppu_frame_cache_lookup(split))
+        return;
+
+    // Sprites come from the registers at the start of the scanline, later
+    // writes only clip them
+    for (i = 0; i < 256; i++)
+        ppu_sprite_line[i] = 0;
+    if (ppu_render_shows_sprites() || split)
+        ppu_draw_sprite_scanline();
+
+    int origin = ((ppu_render.v & 31) << 3) + ppu_render.fine_x;
+    for (;;) {
+        bool more = ppu_log_read < packet->log_count && packet->log[ppu_log_read].scanline == scanline;
+        int end = 256;
+        if (more && packet->log[ppu_log_read].dot < end)
+            end = packet->log[ppu_log_read].dot > x ? packet->log[ppu_log_read].dot : x;
+
+        ppu_draw_span(x, end, origin);
+        x = end;
+        if (!more)
+            break;
+        origin = ppu_apply_log_entry(&packet->log[ppu_log_read++], x, origin);
+    }
+
+    nes_flush_scanline(scanline, ppu_color_line, packet->line_state[scanline].mask >> 5);
+}
+
+// Skipped frames only catch up on memory
+void ppu_present_frame(bool skipped)
+{
+    const ppu_frame_packet *packet = ppu_rendered_packet;
+    int i;
 
-        // PPU can't render > 8 sprites
-        if (scanline_sprite_count > 8) {
-            ppu_set_sprite_overflow(true);
-            // break;
+    if (ppu_frame_cache_enabled && !skipped) {
+        int reused = 0;
+        for (i = 0; i < PPU_SCANLINES; i++) {
+            reused += ppu_line_reused[i];
+            ppu_line_reused[i] = false;
         }
+        ppu_frame_cache.frames++;
+        ppu_frame_cache.lines += PPU_SCANLINES;
+        ppu_frame_cache.lines_reused += reused;
+        if (reused == PPU_SCANLINES)
+            ppu_frame_cache.frames_reused++;
+    }
+    ppu_log_read = 0;
 
-        bool vflip = PPU_SPRRAM[n + 2] & 0x80;
-        bool hflip = PPU_SPRRAM[n + 2] & 0x40;
+    if (packet->overflow) {
+        memcpy(ppu_render_ram, packet->ram, sizeof(ppu_render_ram));
+        memcpy(ppu_render_sprram, packet->sprram, sizeof(ppu_render_sprram));
+        for (i = 0; i < 4; i++)
+            ppu_render_nametable_page[i] = ppu_mirroring_pages[packet->mirroring][i];
+        ppu_nametable_cache_invalidate();
+        ppu_oam_dirty = true;
+        ppu_render_generation++;
+    }
 
-        word tile_address = ppu_sprite_pattern_table_address() + 16 * PPU_SPRRAM[n + 1];
-        int y_in_tile = ppu.scanline & 0x7;
-        byte l = ppu_ram_read(tile_address + (vflip ? (7 - y_in_tile) : y_in_tile));
-        byte h = ppu_ram_read(tile_address + (vflip ? (7 - y_in_tile) : y_in_tile) + 8);
+    if (!skipped)
+        fce_update_screen();
+}
 
-        byte palette_attribute = PPU_SPRRAM[n + 2] & 0x3;
-        word palette_address = 0x3F10 + (palette_attribute << 2);
-        int x;
-        for (x = 0; x < 8; x++) {
-            int color = hflip ? PLAF(l,h,x) : PLA(l,h,x);
+byte ppu_backdrop_color()
+{
+    return ppu_render_ram[0x3F00];
+}
 
-            // Color 0 is transparent
-            if (color != 0) {
-                int screen_x = sprite_x + x;
-                int idx = ppu_ram_read(palette_address + color);
-                
-                if (PPU_SPRRAM[n + 2] & 0x20) {
-                    pixbuf_add(bbg, screen_x, sprite_y + y_in_tile + 1, idx);
-                }
-                else {
-                    pixbuf_add(fg, screen_x, sprite_y + y_in_tile + 1, idx);
-                }
-
-                // Checking sprite 0 hit
-                if (ppu_shows_background() && !ppu_sprite_hit_occured && n == 0 && ppu_screen_background[screen_x][sprite_y + y_in_tile] == color) {
-                    ppu_set_sprite_0_hit(true);
-                    ppu_sprite_hit_occured = true;
-                }
-            }
+
+
+// Band Rendering
+
+// Finds the scanline events of a packet and checks that its scanlines can
+// be drawn in any order: nothing but scanline events between the first and
+// the last one, and a single background pattern table and sprite height,
+// so that the nametable cache and sprite lists stay the same all frame.
+bool ppu_packet_has_bands(const ppu_frame_packet *packet)
+{
+    int start, i, line = 0;
+
+    for (start = 0; start < packet->event_count; start++)
+        if (packet->events[start].type == PPU_EVENT_SCANLINE)
+            break;
+
+    for (i = start; i < packet->event_count && line < PPU_SCANLINES; i++, line++) {
+        if (packet->events[i].type != PPU_EVENT_SCANLINE || packet->events[i].address != line)
+            return false;
+    }
+    if (line < PPU_SCANLINES)
+        return false;
+
+    byte ctrl = packet->line_state[0].ctrl & 0x30;
+    for (line = 1; line < PPU_SCANLINES; line++)
+        if ((packet->line_state[line].ctrl & 0x30) != ctrl)
+            return false;
+    for (i = 0; i < packet->log_count; i++)
+        if (packet->log[i].reg == PPU_LOG_CTRL && (packet->log[i].value & 0x10) != (ctrl & 0x10))
+            return false;
+
+    ppu_band_events_start = start;
+    ppu_band_events_end = start + PPU_SCANLINES;
+    return true;
+}
+
+bool ppu_prepare_bands(ppu_frame_packet *packet)
+{
+    int i, page, row;
+
+    if (!ppu_packet_has_bands(packet))
+        return false;
+
+    ppu_rendered_packet = packet;
+    for (i = 0; i < ppu_band_events_start; i++)
+        ppu_render_event(&packet->events[i]);
+
+    // Leave the bands nothing to update but their own scanlines
+    ppu_render = packet->line_state[0];
+    ppu_nametable_cache_validate();
+    for (i = 0; i < 4; i++) {
+        page = ppu_render_nametable_page[i];
+        for (row = 0; row < 30; row++)
+            if (ppu_nametable_dirty[page][row])
+                ppu_nametable_cache_refresh(page, row);
+    }
+    if (ppu_oam_dirty || ppu_oam_sprite_height != ppu_render_sprite_height())
+        ppu_evaluate_sprites();
+    return true;
+}
+
+void ppu_render_band(ppu_frame_packet *packet, int band, int bands)
+{
+    int first = band * PPU_SCANLINES / bands;
+    int last = (band + 1) * PPU_SCANLINES / bands;
+    int line;
+
+    ppu_log_read = 0;
+    while (ppu_log_read < packet->log_count && packet->log[ppu_log_read].scanline < first)
+        ppu_log_read++;
+
+    for (line = first; line < last; line++)
+        ppu_draw_scanline(line);
+}
+
+void ppu_finish_bands(ppu_frame_packet *packet)
+{
+    int i;
+
+    for (i = ppu_band_events_end; i < packet->event_count; i++)
+        ppu_render_event(&packet->events[i]);
+}
+
+
+
+// Sprite Status
+
+void ppu_evaluate_sprite_status()
+{
+    byte height = ppu_sprite_height();
+    byte count[PPU_SCANLINES];
+    int n, s;
+
+    for (s = 0; s < PPU_SCANLINES; s++) {
+        count[s] = 0;
+        ppu_status_overflow[s] = false;
+    }
+
+    for (n = 0; n < 64; n++) {
+        int last = PPU_SPRRAM[n << 2] + height;
+        if (last >= PPU_SCANLINES)
+            last = PPU_SCANLINES - 1;
+
+        for (s = PPU_SPRRAM[n << 2] + 1; s <= last; s++) {
+            if (++count[s] > 8)
+                ppu_status_overflow[s] = true;
+        }
+    }
+
+    ppu_status_sprite_height = height;
+    ppu_status_dirty = false;
+}
+
+// Opacity of the background tile covering a column (0 - 511) of nametable
+// n and its horizontal neighbour side by side, on row y, MSB first
+byte ppu_background_tile_opacity(int n, int y, int column)
+{
+    column &= 511;
+    word nametable = ppu_base_nametable_addresses[n ^ (column >> 8)];
+    byte tile = ppu_ram_read(nametable + ((y >> 3) << 5) + ((column & 255) >> 3));
+    word address = ppu_background_pattern_table_address() + 16 * tile + (y & 7);
+    return ppu_ram_read(address) | ppu_ram_read(address + 8);
+}
+
+// Sets sprite 0 hit if an opaque pixel of sprite 0 covers an opaque
+// background pixel of the scanline starting now. Only the two background
+// tiles under the sprite are fetched.
+void ppu_check_sprite_0_hit()
+{
+    int sprite_x = PPU_SPRRAM[3];
+    byte attr = PPU_SPRRAM[2];
+    word address = ppu_sprite_row_address(PPU_SPRRAM[1], attr, ppu.scanline - PPU_SPRRAM[0] - 1,
+                                          ppu_sprite_height(), ppu_sprite_pattern_table_address());
+    byte sprite = ppu_ram_read(address) | ppu_ram_read(address + 8);
+    if (attr & 0x40)
+        sprite = ppu_bit_reverse_table[sprite];
+
+    int y = ((ppu.v >> 2) & 0xF8) | (ppu.v >> 12);
+    if (y >= PPU_SCANLINES)
+        return;
+
+    int n = (ppu.v >> 10) & 3;
+    int column = ((ppu.v & 31) << 3) + ppu.fine_x + sprite_x;
+    word window = (ppu_background_tile_opacity(n, y, column) << 8) | ppu_background_tile_opacity(n, y, column + 8);
+    byte background = window >> (8 - (column & 7));
+
+    // No hit at x = 255, nor in the leftmost 8 pixels when either layer is clipped there
+    byte valid = 0xFF;
+    if (sprite_x > 247)
+        valid <<= sprite_x - 247;
+    if (sprite_x < 8 && !(ppu_shows_sprites_in_leftmost_8px() && ppu_shows_background_in_leftmost_8px()))
+        valid &= 0xFF >> (8 - sprite_x);
+
+    if (background & sprite & valid) {
+        ppu_set_sprite_0_hit(true);
+        ppu_sprite_hit_occured = true;
+    }
+}
+
+// Sprite overflow and sprite 0 hit of the scanline starting now, visible
+// to the CPU before the scanline is drawn. Sprites are evaluated, and can
+// overflow, whenever rendering is on; a hit needs both layers shown.
+void ppu_update_sprite_status()
+{
+    if (!(ppu_shows_background() || ppu_shows_sprites()))
+        return;
+
+    if (ppu_status_dirty || ppu_status_sprite_height != ppu_sprite_height())
+        ppu_evaluate_sprite_status();
+
+    if (ppu_status_overflow[ppu.scanline])
+        ppu_set_sprite_overflow(true);
+
+    int row = ppu.scanline - PPU_SPRRAM[0] - 1;
+    if (row >= 0 && row < ppu_sprite_height() && !ppu_sprite_hit_occured &&
+        ppu_shows_background() && ppu_shows_sprites())
+        ppu_check_sprite_0_hit();
+}
+
+
+
+// Register Log
+
+// Writes past the last pixel need no entry, the next scanline starts
+// with them anyway
+void ppu_log_write(byte reg, word value)
+{
+    if (ppu.scanline < 0 || ppu.scanline >= PPU_SCANLINES || ppu_frame_skipped ||
+        ppu_packet->log_count == PPU_LOG_SIZE)
+        return;
+
+    unsigned long long dot = cpu_clock() * 3 - ppu_scanline_start_dot;
+    if (dot >= 256)
+        return;
+
+    ppu_log_entry *entry = &ppu_packet->log[ppu_packet->log_count++];
+    entry->scanline = ppu.scanline;
+    entry->reg = reg;
+    entry->dot = dot;
+    entry->value = value;
+}
+
+// Records the registers the scanline starting now is drawn with
+void ppu_start_scanline()
+{
+    ppu_render_state *state = &ppu_packet->line_state[ppu.scanline];
+    state->v = ppu.v;
+    state->fine_x = ppu.fine_x;
+    state->ctrl = ppu.PPUCTRL;
+    state->mask = ppu.PPUMASK;
+
+    ppu_update_sprite_status();
+}
+
+// Has the scanline ending now drawn, then moves v on to the next one like
+// the PPU does at dots 256 - 257 (and 280 - 304 of the pre-render
+// scanline) while rendering is enabled
+void ppu_end_scanline()
+{
+    if (ppu.scanline >= 0 && ppu.scanline < PPU_SCANLINES && !ppu_frame_skipped)
+        ppu_emit(PPU_EVENT_SCANLINE, 0, ppu.scanline);
+
+    if (ppu.scanline >= PPU_SCANLINES || !(ppu_shows_background() || ppu_shows_sprites()))
+        return;
+
+    // Fine Y, then coarse Y, which moves to the other nametable after row 29
+    if ((ppu.v & 0x7000) != 0x7000) {
+        ppu.v += 0x1000;
+    }
+    else {
+        int coarse_y = (ppu.v >> 5) & 31;
+        ppu.v &= ~0x7000;
+        if (coarse_y == 29) {
+            coarse_y = 0;
+            ppu.v ^= 0x0800;
+        }
+        else if (coarse_y == 31) {
+            coarse_y = 0;
         }
+        else {
+            coarse_y++;
+        }
+        ppu.v = (ppu.v & ~0x03E0) | (coarse_y << 5);
+    }
+
+    ppu.v = (ppu.v & ~0x041F) | (ppu.t & 0x041F);
+    if (ppu.scanline == -1)
+        ppu.v = (ppu.v & ~0x7BE0) | (ppu.t & 0x7BE0);
+}
+
+
+
+// Frame Cache
+
+// Returns true if the current scanline would be drawn exactly as in the
+// previous frame, and records its inputs otherwise. Scanlines split by
+// register writes are always drawn.
+bool ppu_frame_cache_lookup(bool split)
+{
+    ppu_line_digest *digest = &ppu_line_digests[ppu_render_scanline];
+    bool hit = !split &&
+               digest->generation == ppu_render_generation &&
+               digest->state.v == ppu_render.v &&
+               digest->state.fine_x == ppu_render.fine_x &&
+               digest->state.ctrl == ppu_render.ctrl &&
+               digest->state.mask == ppu_render.mask;
+
+    ppu_line_reused[ppu_render_scanline] = hit;
+    if (!hit) {
+        digest->generation = split ? 0 : ppu_render_generation;
+        digest->state = ppu_render;
     }
+    return hit;
+}
+
+void ppu_set_frame_cache(bool yesno)
+{
+    ppu_emit(PPU_EVENT_FRAME_CACHE, yesno, 0);
+}
+
+ppu_frame_cache_stats ppu_get_frame_cache_stats()
+{
+    return ppu_frame_cache;
 }
 
 
@@ -242,6 +850,7 @@ void ppu_draw_sprite_scanline()
 void ppu_run(int cycles)
 {
     while (cycles-- > 0) {
+        ppu_scanline_start_dot = cpu_clock() * 3;
         ppu_cycle();
     }
 }
@@ -251,46 +860,247 @@ void ppu_cycle()
     if (!ppu.ready && cpu_clock() > 29658)
         ppu.ready = true;
 
+    ppu_end_scanline();
     ppu.scanline++;
-    if (ppu_shows_background()) {
-        ppu_draw_background_scanline(false);
-        ppu_draw_background_scanline(true);
-    }
-    
-    if (ppu_shows_sprites()) ppu_draw_sprite_scanline();
+    if (ppu.scanline < SCREEN_HEIGHT)
+        ppu_start_scanline();
 
     if (ppu.scanline == 241) {
         ppu_set_in_vblank(true);
         ppu_set_sprite_0_hit(false);
-        cpu_interrupt();
+        if (ppu_catch_up_enabled)
+            ppu_nmi_pending = true;
+        else
+            cpu_interrupt();
     }
     else if (ppu.scanline == 262) {
+        ppu_emit(PPU_EVENT_FRAME, ppu_frame_skipped, 0);
+        if (ppu_pipelined)
+            ppu_submit_packet();
+        ppu_packet->log_count = 0;
+
         ppu.scanline = -1;
+        ppu_frames++;
+        ppu_start_frame();
         ppu_sprite_hit_occured = false;
         ppu_set_in_vblank(false);
-        fce_update_screen();
     }
 }
 
+unsigned long ppu_frame_count()
+{
+    return ppu_frames;
+}
+
+
+
+// Frameskip
+
+// Decides whether the frame starting now is drawn
+void ppu_start_frame()
+{
+    if (ppu_skip_frames == PPU_SKIP_ALL_FRAMES) {
+        ppu_frame_skipped = true;
+    }
+    else if (ppu_skip_countdown > 0) {
+        ppu_skip_countdown--;
+        ppu_frame_skipped = true;
+    }
+    else {
+        ppu_skip_countdown = ppu_skip_frames;
+        ppu_frame_skipped = false;
+    }
+}
+
+void ppu_set_frame_skip(int skip)
+{
+    ppu_skip_frames = skip < 0 ? PPU_SKIP_ALL_FRAMES : skip;
+    // A frame being drawn is the first of its group, so that the ratio
+    // holds from power-up, where no frame has started yet
+    ppu_skip_countdown = ppu_frame_skipped || skip < 0 ? 0 : skip;
+}
+
+int ppu_frame_skip()
+{
+    return ppu_skip_frames;
+}
+
+
+
+// Frame Packets
+
+// Passes a renderer input on, right away or through the frame packet
+void ppu_emit(byte type, byte data, word address)
+{
+    ppu_event event = { type, data, address };
+    ppu_frame_packet *packet = ppu_packet;
+
+    if (!ppu_pipelined) {
+        ppu_render_event(&event);
+        return;
+    }
+
+    int limit = PPU_PACKET_EVENTS;
+    if (type == PPU_EVENT_VRAM || type == PPU_EVENT_OAM)
+        limit -= PPU_PACKET_RESERVED;
+    if (packet->event_count >= limit) {
+        packet->overflow = true;
+        return;
+    }
+    packet->events[packet->event_count++] = event;
+}
+
+// Hands the finished frame over and starts recording into the other packet
+void ppu_submit_packet()
+{
+    ppu_frame_packet *packet = ppu_packet;
+
+    if (packet->overflow) {
+        memcpy(packet->ram, PPU_RAM, sizeof(packet->ram));
+        memcpy(packet->sprram, PPU_SPRRAM, sizeof(packet->sprram));
+        packet->mirroring = ppu.mirroring;
+    }
+
+    // Returns once the renderer is done with the other packet
+    ppu_packet = (packet == &ppu_packets[0]) ? &ppu_packets[1] : &ppu_packets[0];
+    nes_submit_frame_packet(packet);
+
+    ppu_packet->event_count = 0;
+    ppu_packet->overflow = false;
+}
+
+void ppu_render_event(const ppu_event *event)
+{
+    int i;
+
+    switch (event->type) {
+        case PPU_EVENT_VRAM:
+            ppu_render_ram[event->address] = event->data;
+            if (event->address < 0x2000)
+                ppu_chr_write(event->address);
+            else
+                ppu_nametable_cache_write(event->address);
+            ppu_render_generation++;
+            break;
+        case PPU_EVENT_OAM:
+            ppu_render_sprram[event->address] = event->data;
+            ppu_oam_dirty = true;
+            ppu_render_generation++;
+            break;
+        case PPU_EVENT_MIRRORING:
+            for (i = 0; i < 4; i++)
+                ppu_render_nametable_page[i] = ppu_mirroring_pages[event->data][i];
+            ppu_render_generation++;
+            break;
+        case PPU_EVENT_SPRITE_LIMIT:
+            ppu_sprite_limit = event->data;
+            ppu_oam_dirty = true;
+            ppu_render_generation++;
+            break;
+        case PPU_EVENT_FRAME_CACHE:
+            ppu_frame_cache_enabled = event->data;
+            // Scanlines drawn while the cache was off left no digest behind
+            for (i = 0; i < PPU_SCANLINES; i++)
+                ppu_line_digests[i].generation = 0;
+            break;
+        case PPU_EVENT_SCANLINE:
+            ppu_draw_scanline(event->address);
+            break;
+        case PPU_EVENT_FRAME:
+            ppu_present_frame(event->data);
+            break;
+    }
+}
+
+void ppu_set_pipelined(bool yesno)
+{
+    ppu_pipelined = yesno;
+    ppu_packet->event_count = 0;
+    ppu_packet->overflow = false;
+    ppu_rendered_packet = ppu_packet;
+}
+
+void ppu_render_packet(ppu_frame_packet *packet)
+{
+    int i;
+
+    ppu_rendered_packet = packet;
+    for (i = 0; i < packet->event_count; i++)
+        ppu_render_event(&packet->events[i]);
+}
+
+
+
+// Catch-up Mode
+
+void ppu_set_catch_up(bool yesno)
+{
+    ppu_catch_up_enabled = yesno;
+    ppu_next_scanline_dot = cpu_clock() * 3;
+    ppu_nmi_pending = false;
+}
+
+bool ppu_catches_up()
+{
+    return ppu_catch_up_enabled;
+}
+
+// Runs every scanline that started before the current CPU cycle
+void ppu_sync()
+{
+    if (!ppu_catch_up_enabled)
+        return;
+
+    unsigned long long now = cpu_clock() * 3;
+    while (ppu_next_scanline_dot <= now) {
+        ppu_scanline_start_dot = ppu_next_scanline_dot;
+        ppu_next_scanline_dot += PPU_DOTS_PER_SCANLINE;
+        ppu_cycle();
+    }
+}
+
+void ppu_catch_up()
+{
+    ppu_sync();
+    if (ppu_nmi_pending) {
+        ppu_nmi_pending = false;
+        cpu_interrupt();
+    }
+}
+
+unsigned long long ppu_next_event_cycle()
+{
+    // Scanlines to go until vblank starts or the frame ends
+    int next = ppu.scanline + 1;
+    int lines = next <= 241 ? 241 - next : 262 - next;
+    return (ppu_next_scanline_dot + (unsigned long long) lines * PPU_DOTS_PER_SCANLINE + 2) / 3;
+}
+
 extern inline void ppu_copy(word address, byte *source, int length)
 {
-    memcpy(&PPU_RAM[address], source, length);
+    // Scanlines before a CHR bank switch are drawn with the old tiles
+    ppu_sync();
+
+    int i;
+    for (i = 0; i < length; i++) {
+        if (PPU_RAM[address + i] != source[i]) {
+            PPU_RAM[address + i] = source[i];
+            ppu_emit(PPU_EVENT_VRAM, source[i], address + i);
+        }
+    }
 }
 
 extern inline byte ppu_io_read(word address)
 {
-    ppu.PPUADDR &= 0x3FFF;
+    ppu_sync();
     switch (address & 7) {
         case 2:
         {
             byte value = ppu.PPUSTATUS;
             ppu_set_in_vblank(false);
             ppu_set_sprite_0_hit(false);
-            ppu.scroll_received_x = 0;
-            ppu.PPUSCROLL = 0;
-            ppu.addr_received_high_byte = 0;
+            ppu.w = 0;
             ppu_latch = value;
-            ppu_addr_latch = 0;
             ppu_2007_first_read = true;
             return value;
         }
@@ -299,11 +1109,11 @@ extern inline byte ppu_io_read(word address)
         {
             byte data;
             
-            if (ppu.PPUADDR < 0x3F00) {
-                data = ppu_latch = ppu_ram_read(ppu.PPUADDR);
+            if ((ppu.v & 0x3FFF) < 0x3F00) {
+                data = ppu_latch = ppu_ram_read(ppu.v);
             }
             else {
-                data = ppu_ram_read(ppu.PPUADDR);
+                data = ppu_ram_read(ppu.v);
                 ppu_latch = 0;
             }
             
@@ -311,7 +1121,7 @@ extern inline byte ppu_io_read(word address)
                 ppu_2007_first_read = false;
             }
             else {
-                ppu.PPUADDR += ppu_vram_address_increment();
+                ppu.v = (ppu.v + ppu_vram_address_increment()) & 0x7FFF;
             }
             return data;
         }
@@ -322,58 +1132,83 @@ extern inline byte ppu_io_read(word address)
 
 extern inline void ppu_io_write(word address, byte data)
 {
+    ppu_sync();
     address &= 7;
     ppu_latch = data;
-    ppu.PPUADDR &= 0x3FFF;
     switch(address) {
-        case 0: if (ppu.ready) ppu.PPUCTRL = data; break;
-        case 1: if (ppu.ready) ppu.PPUMASK = data; break;
-        case 3: ppu.OAMADDR = data; break;
-        case 4: PPU_SPRRAM[ppu.OAMADDR++] = data; break;
-        case 5:
+        case 0:
         {
-            if (ppu.scroll_received_x)
-                ppu.PPUSCROLL_Y = data;
-            else
-                ppu.PPUSCROLL_X = data;
+            if (!ppu.ready)
+                return;
 
-            ppu.scroll_received_x ^= 1;
+            // Only the background pattern table takes effect mid-scanline
+            if ((ppu.PPUCTRL ^ data) & 0x10)
+                ppu_log_write(PPU_LOG_CTRL, data);
+            ppu.PPUCTRL = data;
+            ppu.t = (ppu.t & ~0x0C00) | ((data & 0x3) << 10);
             break;
         }
-        case 6:
+        case 1:
         {
             if (!ppu.ready)
                 return;
 
-            if (ppu.addr_received_high_byte)
-                ppu.PPUADDR = (ppu_addr_latch << 8) + data;
-            else
-                ppu_addr_latch = data;
+            if (ppu.PPUMASK != data)
+                ppu_log_write(PPU_LOG_MASK, data);
+            ppu.PPUMASK = data;
+            break;
+        }
+        case 3: ppu.OAMADDR = data; break;
+        case 4: ppu_sprram_write(data); break;
+        case 5:
+        {
+            if (ppu.w) {
+                ppu.t = (ppu.t & ~0x73E0) | ((data & 0x07) << 12) | ((data & 0xF8) << 2);
+            }
+            else {
+                ppu.t = (ppu.t & ~0x001F) | (data >> 3);
+                if (ppu.fine_x != (data & 0x07))
+                    ppu_log_write(PPU_LOG_FINE_X, data & 0x07);
+                ppu.fine_x = data & 0x07;
+            }
 
-            ppu.addr_received_high_byte ^= 1;
-            ppu_2007_first_read = true;
+            ppu.w ^= 1;
             break;
         }
-        case 7:
+        case 6:
         {
-            if (ppu.PPUADDR > 0x1FFF || ppu.PPUADDR < 0x4000) {
-                ppu_ram_write(ppu.PPUADDR ^ ppu.mirroring_xor, data);
-                ppu_ram_write(ppu.PPUADDR, data);
+            if (!ppu.ready)
+                return;
+
+            if (ppu.w) {
+                ppu.t = (ppu.t & 0xFF00) | data;
+                ppu.v = ppu.t;
+                ppu_log_write(PPU_LOG_V, ppu.v);
             }
             else {
-                ppu_ram_write(ppu.PPUADDR, data);
+                ppu.t = (ppu.t & 0x00FF) | ((data & 0x3F) << 8);
             }
+
+            ppu.w ^= 1;
+            ppu_2007_first_read = true;
+            break;
         }
+        case 7: ppu_ram_write(ppu.v, data); break;
     }
     ppu_latch = data;
 }
 
 void ppu_init()
 {
-    ppu.PPUCTRL = ppu.PPUMASK = ppu.PPUSTATUS = ppu.OAMADDR = ppu.PPUSCROLL_X = ppu.PPUSCROLL_Y = ppu.PPUADDR = 0;
+    ppu.PPUCTRL = ppu.PPUMASK = ppu.PPUSTATUS = ppu.OAMADDR = 0;
+    ppu.v = ppu.t = ppu.fine_x = ppu.w = 0;
     ppu.PPUSTATUS |= 0xA0;
     ppu.PPUDATA = 0;
     ppu_2007_first_read = true;
+    ppu_oam_dirty = true;
+    ppu_status_dirty = true;
+    ppu_nametable_cache_invalidate();
+    ppu_set_mirroring(PPU_MIRRORING_HORIZONTAL);
 
     int h, l, x;
     for (h = 0; h < 0x100; h++) {
@@ -384,20 +1219,25 @@ void ppu_init()
             }
         }
     }
-}
 
-void ppu_sprram_write(byte data)
-{
-    PPU_SPRRAM[ppu.OAMADDR++] = data;
+    for (l = 0; l < 0x100; l++) {
+        ppu_bit_reverse_table[l] = 0;
+        for (x = 0; x < 8; x++)
+            ppu_bit_reverse_table[l] |= ((l >> x) & 1) << (7 - x);
+    }
 }
 
-void ppu_set_background_color(byte color)
+void ppu_sprram_write(byte data)
 {
-    nes_set_bg_color(color);
+    if (PPU_SPRRAM[ppu.OAMADDR] != data) {
+        PPU_SPRRAM[ppu.OAMADDR] = data;
+        ppu_status_dirty = true;
+        ppu_emit(PPU_EVENT_OAM, data, ppu.OAMADDR);
+    }
+    ppu.OAMADDR++;
 }
 
-void ppu_set_mirroring(byte mirroring)
+void ppu_set_sprite_limit(bool yesno)
 {
-    ppu.mirroring = mirroring;
-    ppu.mirroring_xor = 0x400 << mirroring;
+    ppu_emit(PPU_EVENT_SPRITE_LIMIT, yesno, 0);
 }
@@ -0,0 +1,214 @@
+/*
+Frame archive, see frame-archive.h for the layout:
+
+  header | index (capacity entries) | padding | payloads (capacity slots)
+
+The file is sized for capacity frames when it is created and mapped
+shared, so committing a frame is a hash over it and nothing else; the
+kernel writes the pages back. The header counts are kept current after
+every commit, which leaves an interrupted capture readable. Closing the
+archive cuts the unused payload slots off the end of the file.
+*/
+#ifndef YATCPU
+
+#include "frame-archive.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FRAME_ARCHIVE_PAGE 4096
+
+struct frame_archive {
+    byte *map;
+    size_t map_size;
+    int fd;
+    bool writable;
+    frame_archive_header *header;
+    frame_archive_entry *index;
+    byte *payloads;
+};
+
+static void frame_archive_map(frame_archive *archive)
+{
+    archive->header = (frame_archive_header *) archive->map;
+    archive->index = (frame_archive_entry *) (archive->map + sizeof(frame_archive_header));
+    archive->payloads = archive->map + archive->header->payload_offset;
+}
+
+// 64-bit FNV-1a over 8 bytes at a time, frame sizes are a multiple of 8
+static uint64_t frame_archive_hash(const byte *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    return hash;
+}
+
+
+
+// Writing
+
+frame_archive *frame_archive_create(const char *path, int width, int height,
+                                    int bytes_per_pixel, unsigned capacity)
+{
+    if (capacity == 0)
+        return NULL;
+    frame_archive *archive = malloc(sizeof(frame_archive));
+    if (archive == NULL)
+        return NULL;
+
+    size_t frame_size = (size_t) width * height * bytes_per_pixel;
+    size_t payload_offset = sizeof(frame_archive_header) + capacity * sizeof(frame_archive_entry);
+    payload_offset = (payload_offset + FRAME_ARCHIVE_PAGE - 1) & ~(size_t) (FRAME_ARCHIVE_PAGE - 1);
+
+    archive->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    archive->map_size = payload_offset + capacity * frame_size;
+    archive->writable = true;
+    if (archive->fd < 0 || ftruncate(archive->fd, archive->map_size) != 0)
+        goto fail;
+
+    archive->map = mmap(NULL, archive->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, archive->fd, 0);
+    if (archive->map == MAP_FAILED)
+        goto fail;
+
+    frame_archive_header *header = (frame_archive_header *) archive->map;
+    memcpy(header->magic, FRAME_ARCHIVE_MAGIC, sizeof(header->magic));
+    header->version = FRAME_ARCHIVE_VERSION;
+    header->width = width;
+    header->height = height;
+    header->bytes_per_pixel = bytes_per_pixel;
+    header->frame_size = frame_size;
+    header->capacity = capacity;
+    header->frame_count = 0;
+    header->payload_count = 0;
+    header->payload_offset = payload_offset;
+    frame_archive_map(archive);
+    return archive;
+
+fail:
+    if (archive->fd >= 0)
+        close(archive->fd);
+    free(archive);
+    return NULL;
+}
+
+void *frame_archive_next(frame_archive *archive)
+{
+    frame_archive_header *header = archive->header;
+    if (header->frame_count == header->capacity)
+        return NULL;
+    return archive->payloads + (size_t) header->payload_count * header->frame_size;
+}
+
+void frame_archive_commit(frame_archive *archive)
+{
+    frame_archive_header *header = archive->header;
+    const byte *frame = archive->payloads + (size_t) header->payload_count * header->frame_size;
+    frame_archive_entry *entry = &archive->index[header->frame_count];
+
+    entry->hash = frame_archive_hash(frame, header->frame_size);
+    entry->reserved = 0;
+    entry->payload = header->payload_count;
+
+    // The hash finds repeats, the compare rules out collisions
+    if (header->frame_count > 0) {
+        const frame_archive_entry *previous = entry - 1;
+        const byte *last = archive->payloads + (size_t) previous->payload * header->frame_size;
+        if (previous->hash == entry->hash && memcmp(last, frame, header->frame_size) == 0)
+            entry->payload = previous->payload;
+    }
+
+    if (entry->payload == header->payload_count)
+        header->payload_count++;
+    header->frame_count++;
+}
+
+bool frame_archive_append(frame_archive *archive, const void *frame)
+{
+    void *payload = frame_archive_next(archive);
+    if (payload == NULL)
+        return false;
+    memcpy(payload, frame, archive->header->frame_size);
+    frame_archive_commit(archive);
+    return true;
+}
+
+
+
+// Reading
+
+frame_archive *frame_archive_open(const char *path)
+{
+    frame_archive *archive = malloc(sizeof(frame_archive));
+    struct stat st;
+    if (archive == NULL)
+        return NULL;
+
+    archive->writable = false;
+    archive->fd = open(path, O_RDONLY);
+    if (archive->fd < 0 || fstat(archive->fd, &st) != 0 || st.st_size < (off_t) sizeof(frame_archive_header))
+        goto fail;
+
+    archive->map_size = st.st_size;
+    archive->map = mmap(NULL, archive->map_size, PROT_READ, MAP_SHARED, archive->fd, 0);
+    if (archive->map == MAP_FAILED)
+        goto fail;
+
+    const frame_archive_header *header = (const frame_archive_header *) archive->map;
+    if (memcmp(header->magic, FRAME_ARCHIVE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != FRAME_ARCHIVE_VERSION ||
+        header->frame_count > header->capacity ||
+        sizeof(frame_archive_header) + (size_t) header->capacity * sizeof(frame_archive_entry) > header->payload_offset ||
+        header->payload_offset + (size_t) header->payload_count * header->frame_size > archive->map_size) {
+        munmap(archive->map, archive->map_size);
+        goto fail;
+    }
+    frame_archive_map(archive);
+    return archive;
+
+fail:
+    if (archive->fd >= 0)
+        close(archive->fd);
+    free(archive);
+    return NULL;
+}
+
+const frame_archive_header *frame_archive_info(const frame_archive *archive)
+{
+    return archive->header;
+}
+
+const void *frame_archive_frame(const frame_archive *archive, unsigned n)
+{
+    const frame_archive_header *header = archive->header;
+    if (n >= header->frame_count || archive->index[n].payload >= header->payload_count)
+        return NULL;
+    return archive->payloads + (size_t) archive->index[n].payload * header->frame_size;
+}
+
+void frame_archive_close(frame_archive *archive)
+{
+    off_t used = archive->header->payload_offset +
+                 (off_t) archive->header->payload_count * archive->header->frame_size;
+
+    munmap(archive->map, archive->map_size);
+    if (archive->writable) {
+        // A file left at full size is still a valid archive
+        int result = ftruncate(archive->fd, used);
+        (void) result;
+    }
+    close(archive->fd);
+    free(archive);
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*
+Frame pacer, see frame-pacer.h.
+
+Frame n is due at epoch + n * period, computed from n every time rather
+than accumulated. A frame that finishes early sleeps on an absolute
+CLOCK_MONOTONIC deadline, which the kernel overshoots by tens of
+microseconds; it wakes spin_ns early and spins on the clock for the
+rest. A frame that is late does not wait, and the frames after it catch
+up with the schedule; after a stall of more than FRAME_PACER_MAX_BEHIND
+frames the deadlines start over from now instead.
+
+How long after its deadline each frame starts goes into a histogram of
+one microsecond buckets for the percentiles, late frames included, so
+that deadline misses show in the tail.
+*/
+#ifndef YATCPU
+
+#include "frame-pacer.h"
+
+#include <errno.h>
+#include <time.h>
+
+#define FRAME_PACER_MAX_BEHIND 4
+#define FRAME_PACER_BUCKETS 2000
+
+static double speed = 1;
+static long spin_ns = 200000;
+
+static bool started;
+static int64_t epoch, last_wake;
+static unsigned long frame_index;
+static double period;
+
+static frame_pacer_stats stats;
+static double error_sum;
+static unsigned long histogram[FRAME_PACER_BUCKETS + 1];
+
+static int64_t frame_pacer_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void frame_pacer_sleep_until(int64_t t)
+{
+    struct timespec ts;
+    ts.tv_sec = t / 1000000000;
+    ts.tv_nsec = t % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void frame_pacer_start(int64_t now)
+{
+    epoch = now;
+    frame_index = 0;
+    period = FRAME_PACER_NTSC_NS / speed;
+    started = true;
+}
+
+void frame_pacer_set_speed(double s)
+{
+    speed = s;
+    started = false;
+}
+
+void frame_pacer_set_spin(long ns)
+{
+    spin_ns = ns;
+}
+
+void frame_pacer_wait()
+{
+    if (speed <= 0)
+        return;
+
+    int64_t now = frame_pacer_now();
+    if (!started) {
+        frame_pacer_start(now);
+        last_wake = now;
+        return;
+    }
+
+    int64_t deadline = epoch + (int64_t) (++frame_index * period);
+    stats.frames++;
+    if (now >= deadline) {
+        stats.late++;
+        if (now - deadline > FRAME_PACER_MAX_BEHIND * period) {
+            frame_pacer_start(now);
+            stats.resyncs++;
+        }
+    } else {
+        if (deadline - now > spin_ns)
+            frame_pacer_sleep_until(deadline - spin_ns);
+        while ((now = frame_pacer_now()) < deadline)
+            ;
+    }
+    last_wake = now;
+
+    long error = now - deadline;
+    if (stats.frames == 1 || error < stats.min_ns)
+        stats.min_ns = error;
+    if (error > stats.max_ns)
+        stats.max_ns = error;
+    error_sum += error;
+    histogram[error / 1000 < FRAME_PACER_BUCKETS ? error / 1000 : FRAME_PACER_BUCKETS]++;
+}
+
+// Upper end of the bucket the given fraction of frames falls in
+static long frame_pacer_percentile(double fraction)
+{
+    unsigned long target = (unsigned long) (stats.frames * fraction);
+    unsigned long count = 0;
+    int i;
+
+    for (i = 0; i < FRAME_PACER_BUCKETS; i++) {
+        count += histogram[i];
+        if (count > target)
+            return (i + 1) * 1000L;
+    }
+    return stats.max_ns;
+}
+
+frame_pacer_stats frame_pacer_get_stats()
+{
+    frame_pacer_stats result = stats;
+
+    if (started && last_wake > epoch)
+        result.fps = frame_index * 1e9 / (last_wake - epoch);
+    if (stats.frames > 0) {
+        result.mean_ns = error_sum / stats.frames;
+        result.p50_ns = frame_pacer_percentile(0.5);
+        result.p99_ns = frame_pacer_percentile(0.99);
+        result.p999_ns = frame_pacer_percentile(0.999);
+    }
+    return result;
+}
+
+#endif
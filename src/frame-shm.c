@@ -0,0 +1,251 @@
+/*
+Shared-memory frame ring, see frame-shm.h. The object holds:
+
+  control block (header, published count, slot counters) | padding | slots
+
+Frame n (counting from 1) goes into slot (n - 1) % slots. The writer
+makes the slot counter odd, draws the frame, makes it even again and
+then bumps the published count; it never looks at what readers do. A
+reader takes the slot of the latest frame and its counter, reads, and
+checks that the counter has not moved in the meantime. With the writer
+always drawing into the slot after the latest one, a reader has
+slots - 1 frame times to finish before it is overwritten.
+*/
+#ifndef YATCPU
+
+#include "frame-shm.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FRAME_SHM_PAGE 4096
+
+typedef struct {
+    atomic_uint sequence; // odd while the slot is being written
+    atomic_uint frame;
+} frame_shm_slot;
+
+typedef struct {
+    frame_shm_header header;
+    atomic_uint published;
+    frame_shm_slot slots[FRAME_SHM_MAX_SLOTS];
+} frame_shm_control;
+
+struct frame_shm {
+    byte *map;
+    size_t map_size;
+    frame_shm_control *control;
+    byte *payloads;
+    char name[NAME_MAX];
+};
+
+static byte *frame_shm_slot_data(const frame_shm *shm, unsigned slot)
+{
+    return shm->payloads + (size_t) slot * shm->control->header.frame_size;
+}
+
+
+
+// Writing
+
+frame_shm *frame_shm_create(const char *name, int width, int height,
+                            int bytes_per_pixel, unsigned slots)
+{
+    if (slots < 2 || slots > FRAME_SHM_MAX_SLOTS)
+        return NULL;
+
+    frame_shm *shm = malloc(sizeof(frame_shm));
+    if (shm == NULL)
+        return NULL;
+    snprintf(shm->name, sizeof(shm->name), "%s", name);
+
+    size_t frame_size = (size_t) width * height * bytes_per_pixel;
+    size_t slot_offset = (sizeof(frame_shm_control) + FRAME_SHM_PAGE - 1) & ~(size_t) (FRAME_SHM_PAGE - 1);
+    shm->map_size = slot_offset + slots * frame_size;
+
+    // A fresh object every time: readers still mapping one from an earlier
+    // run keep it, instead of having it truncated under them
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        goto fail;
+    if (ftruncate(fd, shm->map_size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        goto fail;
+    }
+    shm->map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->map == MAP_FAILED) {
+        shm_unlink(name);
+        goto fail;
+    }
+
+    // The object starts out zeroed: no frame published, every slot even
+    shm->control = (frame_shm_control *) shm->map;
+    shm->payloads = shm->map + slot_offset;
+    frame_shm_header *header = &shm->control->header;
+    header->version = FRAME_SHM_VERSION;
+    header->width = width;
+    header->height = height;
+    header->bytes_per_pixel = bytes_per_pixel;
+    header->frame_size = frame_size;
+    header->slots = slots;
+    header->slot_offset = slot_offset;
+
+    // Readers take the header as valid once they see the magic
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, FRAME_SHM_MAGIC, sizeof(FRAME_SHM_MAGIC));
+    return shm;
+
+fail:
+    free(shm);
+    return NULL;
+}
+
+void *frame_shm_begin(frame_shm *shm)
+{
+    unsigned published = atomic_load_explicit(&shm->control->published, memory_order_relaxed);
+    unsigned slot = published % shm->control->header.slots;
+    frame_shm_slot *s = &shm->control->slots[slot];
+
+    unsigned sequence = atomic_load_explicit(&s->sequence, memory_order_relaxed);
+    atomic_store_explicit(&s->sequence, sequence + 1, memory_order_relaxed);
+    // The odd counter has to be visible before any of the new pixels are
+    atomic_thread_fence(memory_order_release);
+    return frame_shm_slot_data(shm, slot);
+}
+
+void frame_shm_publish(frame_shm *shm)
+{
+    unsigned published = atomic_load_explicit(&shm->control->published, memory_order_relaxed);
+    frame_shm_slot *s = &shm->control->slots[published % shm->control->header.slots];
+
+    atomic_store_explicit(&s->frame, published + 1, memory_order_relaxed);
+    atomic_store_explicit(&s->sequence, atomic_load_explicit(&s->sequence, memory_order_relaxed) + 1,
+                          memory_order_release);
+    atomic_store_explicit(&shm->control->published, published + 1, memory_order_release);
+}
+
+unsigned frame_shm_published(const frame_shm *shm)
+{
+    return atomic_load_explicit(&shm->control->published, memory_order_acquire);
+}
+
+void frame_shm_destroy(frame_shm *shm)
+{
+    munmap(shm->map, shm->map_size);
+    shm_unlink(shm->name);
+    free(shm);
+}
+
+
+
+// Reading
+
+frame_shm *frame_shm_open(const char *name)
+{
+    frame_shm *shm = malloc(sizeof(frame_shm));
+    struct stat st;
+    if (shm == NULL)
+        return NULL;
+    snprintf(shm->name, sizeof(shm->name), "%s", name);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        goto fail;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(frame_shm_control)) {
+        close(fd);
+        goto fail;
+    }
+    shm->map_size = st.st_size;
+    shm->map = mmap(NULL, shm->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->map == MAP_FAILED)
+        goto fail;
+
+    // A ring still being set up has no magic yet
+    shm->control = (frame_shm_control *) shm->map;
+    const frame_shm_header *header = &shm->control->header;
+    if (memcmp(header->magic, FRAME_SHM_MAGIC, sizeof(FRAME_SHM_MAGIC)) != 0)
+        goto fail_mapped;
+    atomic_thread_fence(memory_order_acquire);
+    if (header->version != FRAME_SHM_VERSION ||
+        header->slots < 2 || header->slots > FRAME_SHM_MAX_SLOTS ||
+        header->slot_offset < sizeof(frame_shm_control) ||
+        header->slot_offset + (size_t) header->slots * header->frame_size > shm->map_size)
+        goto fail_mapped;
+
+    shm->payloads = shm->map + header->slot_offset;
+    return shm;
+
+fail_mapped:
+    munmap(shm->map, shm->map_size);
+fail:
+    free(shm);
+    return NULL;
+}
+
+const frame_shm_header *frame_shm_info(const frame_shm *shm)
+{
+    return &shm->control->header;
+}
+
+const void *frame_shm_latest(const frame_shm *shm, frame_shm_ticket *ticket)
+{
+    frame_shm_control *control = shm->control;
+
+    for (;;) {
+        unsigned published = atomic_load_explicit(&control->published, memory_order_acquire);
+        if (published == 0)
+            return NULL;
+
+        // Odd only if the writer has come round to the slot since it was
+        // the latest one; a newer frame is published by then
+        unsigned slot = (published - 1) % control->header.slots;
+        unsigned sequence = atomic_load_explicit(&control->slots[slot].sequence, memory_order_acquire);
+        if (sequence & 1)
+            continue;
+
+        ticket->slot = slot;
+        ticket->sequence = sequence;
+        ticket->frame = atomic_load_explicit(&control->slots[slot].frame, memory_order_relaxed);
+        return frame_shm_slot_data(shm, slot);
+    }
+}
+
+bool frame_shm_valid(const frame_shm *shm, const frame_shm_ticket *ticket)
+{
+    // Order the reads of the frame before the second look at the counter
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&shm->control->slots[ticket->slot].sequence, memory_order_relaxed) ==
+           ticket->sequence;
+}
+
+unsigned frame_shm_copy_latest(const frame_shm *shm, void *dst)
+{
+    frame_shm_ticket ticket;
+    const void *frame;
+
+    do {
+        frame = frame_shm_latest(shm, &ticket);
+        if (frame == NULL)
+            return 0;
+        memcpy(dst, frame, shm->control->header.frame_size);
+    } while (!frame_shm_valid(shm, &ticket));
+    return ticket.frame;
+}
+
+void frame_shm_close(frame_shm *shm)
+{
+    munmap(shm->map, shm->map_size);
+    free(shm);
+}
+
+#endif
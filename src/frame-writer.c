@@ -0,0 +1,233 @@
+/*
+Frame dump writer: the thread that presents frames fills recycled frame
+buffers and queues them, and a writer thread does the file I/O, so
+dumping frames only waits on the filesystem when the queue is full and
+the policy says to block.
+
+The queue is a ring of FRAME_WRITER_SLOTS buffers, filled at head and
+written out at tail. Two POSIX semaphores count the filled and the free
+slots and hand the buffers over between the threads: the writer blocks
+on one until a frame is queued, and the presenting thread on the other
+when the ring is full and the policy says to block. Each time the writer
+wakes up it takes every filled slot at once: one writev() into the
+stream file, or a single write() per frame file.
+*/
+#ifndef YATCPU
+
+#include "frame-writer.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FRAME_WRITER_SLOTS 8
+
+// Frame number of the slot that tells the writer to stop
+#define FRAME_WRITER_STOP -1
+
+static frame_writer_policy policy = FRAME_WRITER_BLOCK;
+static const char *stream_path;
+static int stream_given_fd = -1;
+
+static bool running;
+static size_t frame_size;
+static const char *name_format;
+static int stream_fd = -1;
+static pthread_t writer_thread;
+
+static byte *buffers;
+static int frame_numbers[FRAME_WRITER_SLOTS];
+static unsigned head, tail;
+static sem_t slots_filled, slots_free;
+
+// dropped and blocked belong to the presenting thread, the rest to the writer
+static frame_writer_stats stats;
+
+void frame_writer_set_policy(frame_writer_policy p)
+{
+    policy = p;
+}
+
+void frame_writer_set_stream(const char *path)
+{
+    stream_path = path;
+    stream_given_fd = -1;
+}
+
+void frame_writer_set_stream_fd(int fd)
+{
+    stream_path = NULL;
+    stream_given_fd = fd;
+}
+
+
+
+// Writer Thread
+
+static void write_all(int fd, const byte *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t done = write(fd, data, size);
+        if (done <= 0)
+            return;
+        data += done;
+        size -= done;
+    }
+}
+
+static void write_frames(unsigned first, int count)
+{
+    int i;
+
+    if (stream_fd >= 0) {
+        struct iovec iov[FRAME_WRITER_SLOTS];
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = buffers + ((first + i) % FRAME_WRITER_SLOTS) * frame_size;
+            iov[i].iov_len = frame_size;
+        }
+
+        // Finish whatever a short writev() left behind
+        ssize_t done = writev(stream_fd, iov, count);
+        if (done < 0)
+            done = 0;
+        for (i = 0; i < count; i++) {
+            size_t skip = (size_t) done < frame_size ? (size_t) done : frame_size;
+            write_all(stream_fd, (byte *) iov[i].iov_base + skip, frame_size - skip);
+            done -= skip;
+        }
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        unsigned slot = (first + i) % FRAME_WRITER_SLOTS;
+        char filename[64];
+        snprintf(filename, sizeof(filename), name_format, frame_numbers[slot]);
+
+        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            continue;
+        write_all(fd, buffers + slot * frame_size, frame_size);
+        close(fd);
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    bool stop = false;
+
+    (void) arg;
+    while (!stop) {
+        int count = 0;
+
+        while (sem_wait(&slots_filled) != 0)
+            ;
+        do {
+            if (frame_numbers[(tail + count) % FRAME_WRITER_SLOTS] == FRAME_WRITER_STOP) {
+                stop = true;
+                break;
+            }
+            count++;
+        } while (count < FRAME_WRITER_SLOTS && sem_trywait(&slots_filled) == 0);
+        if (count == 0)
+            break;
+
+        write_frames(tail, count);
+        stats.written += count;
+        stats.batches++;
+        while (count-- > 0) {
+            tail++;
+            sem_post(&slots_free);
+        }
+    }
+    return NULL;
+}
+
+
+
+// Presenting Thread
+
+bool frame_writer_start(size_t size, const char *format)
+{
+    frame_size = size;
+    name_format = format;
+
+    buffers = malloc(FRAME_WRITER_SLOTS * size);
+    if (buffers == NULL)
+        return false;
+
+    if (stream_path != NULL) {
+        stream_fd = open(stream_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (stream_fd < 0)
+            goto fail;
+    }
+    else {
+        stream_fd = stream_given_fd;
+    }
+
+    sem_init(&slots_filled, 0, 0);
+    sem_init(&slots_free, 0, FRAME_WRITER_SLOTS);
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0)
+        goto fail;
+
+    running = true;
+    return true;
+
+fail:
+    if (stream_fd >= 0)
+        close(stream_fd);
+    stream_fd = -1;
+    free(buffers);
+    buffers = NULL;
+    return false;
+}
+
+void *frame_writer_acquire()
+{
+    if (!running)
+        return NULL;
+
+    if (sem_trywait(&slots_free) != 0) {
+        if (policy == FRAME_WRITER_DROP) {
+            stats.dropped++;
+            return NULL;
+        }
+        stats.blocked++;
+        while (sem_wait(&slots_free) != 0)
+            ;
+    }
+    return buffers + (head % FRAME_WRITER_SLOTS) * frame_size;
+}
+
+void frame_writer_submit(int frame_number)
+{
+    frame_numbers[head % FRAME_WRITER_SLOTS] = frame_number;
+    head++;
+    sem_post(&slots_filled);
+}
+
+void frame_writer_finish()
+{
+    if (!running)
+        return;
+
+    // The stop marker takes a slot like a frame, behind every queued one
+    while (sem_wait(&slots_free) != 0)
+        ;
+    frame_writer_submit(FRAME_WRITER_STOP);
+    pthread_join(writer_thread, NULL);
+
+    if (stream_fd >= 0)
+        close(stream_fd);
+    stream_fd = -1;
+    running = false;
+}
+
+frame_writer_stats frame_writer_get_stats()
+{
+    return stats;
+}
+
+#endif
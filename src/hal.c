@@ -8,13 +8,18 @@ To port this project, replace the following functions by your own:
 
 2) nes_set_bg_color(c)
     Set the back ground color to be the NES internal color code c.
+    It is used for the area around the 256x240 NES picture.
 
-3) nes_flush_buf(*buf)
-    Flush the entire pixel buf's data to frame buffer.
+3) nes_flush_scanline(y, line, emphasis)
+    Store scanline y (SCREEN_WIDTH NES color codes) in the frame buffer.
+    emphasis (0 - 7) is PPUMASK >> 5 for the scanline; the pixfmt
+    converters take it as the palette bank.
+    Scanlines that are not flushed in a frame must keep their content
+    from the previous frame (see ppu_set_frame_cache).
 
 4) nes_flip_display()
-    Fill the screen with previously set background color, and
-    display all contents in the frame buffer.
+    Display all contents in the frame buffer. Every scanline of the
+    NES picture has been flushed since the previous flip.
 
 5) wait_for_frame()
     Implement it to make the following code is executed FPS times a second:
@@ -22,6 +27,10 @@ To port this project, replace the following functions by your own:
             wait_for_frame();
             do_something();
         }
+    Backends that present live (shm) use the frame pacer (see
+    frame-pacer.c), which can also run at a multiple of the rate or
+    unthrottled. The offline ones (null, dump, archive, stream) do not
+    wait at all and run as fast as the emulator does.
 
 6) int nes_key_state(int b) 
     Query button b's state (1 to be pressed, otherwise 0).
@@ -35,55 +44,99 @@ To port this project, replace the following functions by your own:
       6 - DOWN
       7 - LEFT
       8 - RIGHT
+
+7) nes_submit_frame_packet(packet)
+    Only used with ppu_set_pipelined(true). Have ppu_render_packet(packet)
+    called, now or on another thread, or draw it in bands on several
+    threads, and return once the packet submitted before this one has been
+    rendered. See render-thread.c.
+
+Functions 1) to 6) forward to a nes_hal_backend picked at run time with
+nes_set_hal_backend(). A port can add a backend instead of replacing them:
+  null   - no frame output at all, for measuring the core alone
+  dump   - each frame written to frame_<n>.rgb565 (or .rgb888) in the
+           current directory by a writer thread (see frame-writer.c),
+           stopping after EMU_FRAMES
+  archive - frames drawn straight into a memory-mapped frame archive
+           (see frame-archive.c), without the frame counter so that
+           repeated frames are stored once, stopping once it is full
+  stream - the NES picture as Y4M or raw RGB video on stdout or into a
+           file or FIFO, for an external encoder (see video-stream.c)
+  shm    - the NES picture published into a shared-memory ring for other
+           processes to read live (see frame-shm.c), never waiting on them
+  yatcpu - frames drawn straight into the YATCPU VRAM (YATCPU only)
+The default is yatcpu on YATCPU, dump with LITENES_DEBUG, null otherwise.
+
+Backends store scanlines into a back buffer and present a front one.
+Outside YATCPU there are three buffers, and nes_flip_display() hands the
+finished frame over with an atomic swap (see Frame Handoff). A backend's
+flip_display() then presents it on the emulation thread, as before, or
+on a presenter thread after nes_start_present_thread(), which always
+gets the latest complete frame while the next one is being emulated.
+Screenshots (see screenshot.c) are taken of the frames handed over.
 */
 #include "hal.h"
 #include "fce.h"
 #include "common.h"
+#include "pixfmt.h"
+#include "canvas.h"
+#include "ppu.h"
+#include "frame-writer.h"
+#include "frame-archive.h"
+#include "frame-shm.h"
+#include "frame-pacer.h"
+#include "upscale.h"
 #ifdef YATCPU
 #include "mmio.h"
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
 #endif 
 
 #define REFRESH_TIMER_LIMIT 2083333
 volatile int timer_fired = 0;
 
-#define CANVAS_WIDTH 320
-#define X_OFFSET 32
-#define CANVAS_HEIGHT 240
-
-uint32_t digits[16] = {
-  0x69999996,
-  0x22222222,
-  0x61168886,
-  0xE116111E,
-  0x99961111,
-  0x68861116,
-  0x68869996,
-  0x61111111,
-  0x69969996,
-  0x69961116,
-  0x69996999,
-  0xE99E999E,
-  0x78888887,
-  0xE999999E,
-  0x78868887,
-  0x78868888,
-};
-
 #ifdef RGB888
 typedef uint32_t rgb;
+#define CANVAS_PIXFMT PIXFMT_XRGB8888
 const int left_border_end = 32;
 const int right_border_start = 288;
 const int right_border_end = 320;
 #else
 typedef uint16_t rgb;
+#define CANVAS_PIXFMT PIXFMT_RGB565
 const int left_border_end = 16;
 const int right_border_start = 144;
 const int right_border_end = 160;
 #endif
 
-rgb color_map[64];
-rgb bg_color;
-rgb frame_buffer[CANVAS_WIDTH * CANVAS_HEIGHT];
+int bg_index;
+
+// The frame is composed as NES color codes and converted to RGB once per
+// frame, each scanline with its emphasis bank
+typedef struct {
+    byte frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+    byte emphasis[SCREEN_HEIGHT];
+    byte backdrop;
+} index_buffer;
+
+// Scanlines are stored into the back buffer and backends present the
+// front one. On YATCPU they are the same buffer; elsewhere there are three,
+// handed between the emulator and the presenter (see Frame Handoff).
+#ifdef YATCPU
+#define INDEX_BUFFERS 1
+#else
+#define INDEX_BUFFERS 3
+#endif
+static index_buffer index_buffers[INDEX_BUFFERS];
+static index_buffer *back = &index_buffers[0];
+static index_buffer *front = &index_buffers[INDEX_BUFFERS - 1];
+static bool line_stored[SCREEN_HEIGHT];
 
 uint16_t rgb888to565(unsigned char r, unsigned char g, unsigned char b) {
     uint16_t rgb565 = b >> 3;
@@ -96,81 +149,51 @@ uint32_t packrgb(unsigned char r, unsigned char g, unsigned char b) {
     return (r << 16) | (g << 8) | b;
 }
 
-#ifdef LITENES_DEBUG
+// Frames the dump backend writes before it exits
 #define EMU_FRAMES 600
-#endif
 
 int frames = 0;
 
-/* Wait until next allegro timer event is fired. */
-void wait_for_frame()
+/* Set background color. RGB value of c is defined in fce.h */
+static void store_bg_color(int c)
 {
-    #ifdef YATCPU
-    // timer_fired = 0;
-    // while(!timer_fired);
-    #endif
+    bg_index = c & 0x3F;
 }
 
-/* Set background color. RGB value of c is defined in fce.h */
-void nes_set_bg_color(int c)
-{
-    bg_color = color_map[c];
-    int bgc = bg_color;
-    #ifdef YATCPU
-    int *fbuf = ((int *) frame_buffer);
-    int *vram = ((int *) VRAM);
-    #ifdef RGB888
-    #else
-    unsigned int bgcext = (bgc << 16) | bgc;
-    #endif
-    for (int y = 0; y < CANVAS_HEIGHT; ++y) {
-        for (int x = left_border_end; x < right_border_start; ++x) {
-            int i = y * right_border_end + x;
-            #ifdef RGB888
-            vram[i] = fbuf[i] = bgc;
-            #else
-            vram[i] = fbuf[i] = bgcext;
-            #endif
-        }
-    }
-    #else
-    int* fbuf = ((int*)frame_buffer);
-    for (int i = 0; i < CANVAS_HEIGHT * CANVAS_WIDTH / 2; ++i) {
-        fbuf[i] = bgc << 16 | bgc;
-    }
-    #endif
+/* Flush a scanline */
+static void store_scanline(int y, const byte *line, int emphasis) {
+    memcpy(back->frame[y], line, SCREEN_WIDTH);
+    back->emphasis[y] = emphasis;
+    line_stored[y] = true;
 }
 
-static void draw_digit(int x, int y, int digit) {
-    uint32_t bits = digits[digit];
-    for (int h = 0; h < 8; ++h) {
-        for (int w = 0; w < 4; ++w) {
-            if (bits & (1 << ((7 - h) * 4 + (3 - w)))) {
-                frame_buffer[(y + h) * CANVAS_WIDTH + (x + w)] = (rgb) 0xFFFFFFFF;
-            }
-        }
-    }
+/* Convert the frame into a canvas and stamp the frame counter on it */
+static void compose_canvas(rgb *canvas) {
+    canvas_compose(CANVAS_PIXFMT, canvas, front->frame[0], front->emphasis, front->backdrop, frames);
 }
 
-static void draw_frame_counter(int x, int y) {
-    int frame_count = frames;
-    for (int i = 0; i < 8; ++i) {
-        int digit = ((0xF << (i * 4)) & frame_count) >> (i * 4);
-        draw_digit(x + (7 - i) * 5, y, digit);
-    }
+/* No input device on any backend yet */
+static int no_keys(int b)
+{
+    (void) b;
+    return 0;
 }
 
-/* Flush the pixel buffer */
-void nes_flush_buf(PixelBuf *buf) {
-    int i;
-    
-    for (i = 0; i < buf->size; i ++) {
-        Pixel *p = &buf->buf[i];
-        int x = ((p->xyc & 0xFFF00000) >> 20) + X_OFFSET;
-        int y = (p->xyc & 0xFFF00) >> 8;
-        int c = p->xyc & 0x3F;
-        frame_buffer[y * CANVAS_WIDTH + x] = color_map[c];
-    }
+static void do_nothing() { }
+
+/* Set by a backend that has output all it is going to. It may be
+   presenting on the presenter or render thread, so it does not exit
+   itself: the emulation thread sees nes_hal_done(), stops and calls
+   nes_hal_finish() once. */
+#ifdef YATCPU
+static bool output_done;
+#else
+static atomic_bool output_done;
+#endif
+
+bool nes_hal_done()
+{
+    return output_done;
 }
 
 #ifdef YATCPU
@@ -190,91 +213,498 @@ void trap_handler(void *epc, unsigned int cause) {
 void enable_interrupt();
 #endif 
 
+
+
+// Null Backend
+
+static void null_set_bg_color(int c) { (void) c; }
+static void null_flush_scanline(int y, const byte *line, int emphasis) { (void) y; (void) line; (void) emphasis; }
+
+const nes_hal_backend nes_hal_null = {
+    "null", do_nothing, null_set_bg_color, null_flush_scanline, do_nothing, do_nothing, no_keys, do_nothing
+};
+
+
+
+// File Dump Backend
+
+#ifndef YATCPU
+static void dump_init()
+{
+    #ifdef RGB888
+    const char *name_format = "frame_%d.rgb888";
+    #else
+    const char *name_format = "frame_%d.rgb565";
+    #endif
+    if (!frame_writer_start(sizeof(rgb) * CANVAS_WIDTH * CANVAS_HEIGHT, name_format)) {
+        printf("Error: failed to start the frame writer.\n");
+        exit(1);
+    }
+}
+
+static void dump_finish()
+{
+    frame_writer_finish();
+    ppu_frame_cache_stats stats = ppu_get_frame_cache_stats();
+    printf("Frame cache: %lu/%lu frames, %lu/%lu scanlines reused\n",
+           stats.frames_reused, stats.frames, stats.lines_reused, stats.lines);
+    frame_writer_stats writer = frame_writer_get_stats();
+    printf("Frame writer: %lu frames written in %lu batches, %lu dropped, %lu waits\n",
+           writer.written, writer.batches, writer.dropped, writer.blocked);
+}
+
+/* Frames are queued for the writer thread; with the drop policy a frame
+   finding the queue full is skipped */
+static void dump_flip_display()
+{
+    if (output_done)
+        return;
+    rgb *canvas = frame_writer_acquire();
+    if (canvas) {
+        compose_canvas(canvas);
+        frame_writer_submit(frames);
+    }
+
+    if (frames >= EMU_FRAMES)
+        output_done = true;
+    ++frames;
+}
+
+const nes_hal_backend nes_hal_dump = {
+    "dump", dump_init, store_bg_color, store_scanline, dump_flip_display, do_nothing, no_keys, dump_finish
+};
+#endif
+
+
+
+// Archive Backend
+
+#ifndef YATCPU
+static const char *archive_path = "frames.lnfa";
+static int archive_frames = EMU_FRAMES + 1;
+static frame_archive *archive;
+
+void nes_set_archive_output(const char *path, int frames)
+{
+    archive_path = path;
+    archive_frames = frames;
+}
+
+static void archive_init()
+{
+    if (archive_frames < 1) {
+        printf("Error: the frame archive needs room for at least one frame.\n");
+        exit(1);
+    }
+    archive = frame_archive_create(archive_path, CANVAS_WIDTH, CANVAS_HEIGHT, sizeof(rgb), archive_frames);
+    if (archive == NULL) {
+        printf("Error: failed to create frame archive %s.\n", archive_path);
+        exit(1);
+    }
+}
+
+static void archive_finish()
+{
+    if (archive == NULL)
+        return;
+    const frame_archive_header *info = frame_archive_info(archive);
+    printf("Frame archive: %u frames, %u stored\n", info->frame_count, info->payload_count);
+    frame_archive_close(archive);
+    archive = NULL;
+}
+
+static void archive_flip_display()
+{
+    if (output_done)
+        return;
+    rgb *canvas = frame_archive_next(archive);
+    if (canvas == NULL) {
+        output_done = true;
+        return;
+    }
+    canvas_convert_frame(CANVAS_PIXFMT, canvas, front->frame[0], front->emphasis, front->backdrop);
+    frame_archive_commit(archive);
+
+    if (frame_archive_next(archive) == NULL)
+        output_done = true;
+}
+
+const nes_hal_backend nes_hal_archive = {
+    "archive", archive_init, store_bg_color, store_scanline, archive_flip_display, do_nothing, no_keys, archive_finish
+};
+#endif
+
+
+
+// Stream Backend
+
+#ifndef YATCPU
+static const char *stream_path = "-";
+static video_stream_format stream_format = VIDEO_STREAM_Y4M;
+
+void nes_set_stream_output(const char *path, video_stream_format format)
+{
+    stream_path = path;
+    stream_format = format;
+}
+
+/* Frames go through the frame writer, which blocks rather than drop any
+   unless FRAME_WRITER_DROP is set */
+static void stream_init()
+{
+    int fd;
+    if (strcmp(stream_path, "-") == 0) {
+        // Keep stdout for the video, messages printed from now on (and
+        // any still buffered) go to stderr
+        fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    else {
+        fd = open(stream_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        printf("Error: failed to open %s.\n", stream_path);
+        exit(1);
+    }
+
+    // A pipe as large as a few frames saves the writer most of its wakeups
+    #ifdef F_SETPIPE_SZ
+    fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+    #endif
+
+    char header[128];
+    int length = video_stream_header(stream_format, header, sizeof(header));
+    if (length > 0 && write(fd, header, length) != length) {
+        printf("Error: failed to write the stream header.\n");
+        exit(1);
+    }
+
+    video_stream_init();
+    frame_writer_set_stream_fd(fd);
+    if (!frame_writer_start(video_stream_frame_size(stream_format), NULL)) {
+        printf("Error: failed to start the frame writer.\n");
+        exit(1);
+    }
+}
+
+static void stream_finish()
+{
+    frame_writer_finish();
+    frame_writer_stats writer = frame_writer_get_stats();
+    fprintf(stderr, "Stream: %lu frames written in %lu batches, %lu dropped, %lu waits\n",
+            writer.written, writer.batches, writer.dropped, writer.blocked);
+}
+
+static void stream_flip_display()
+{
+    byte *out = frame_writer_acquire();
+    if (out) {
+        video_stream_encode(stream_format, front->frame[0], front->emphasis, out);
+        frame_writer_submit(frames);
+    }
+    ++frames;
+}
+
+const nes_hal_backend nes_hal_stream = {
+    "stream", stream_init, store_bg_color, store_scanline, stream_flip_display, do_nothing, no_keys, stream_finish
+};
+#endif
+
+
+
+// Shared Memory Backend
+
+#ifndef YATCPU
+static const char *shm_name = "/litenes";
+static unsigned shm_slots = 4;
+static upscale_mode shm_scale = UPSCALE_NONE;
+static frame_shm *shm;
+
+void nes_set_shm_output(const char *name, unsigned slots)
+{
+    shm_name = name;
+    shm_slots = slots;
+}
+
+void nes_set_shm_scale(upscale_mode mode)
+{
+    shm_scale = mode;
+}
+
+static void shm_init()
+{
+    int factor = upscale_factor(shm_scale);
+    shm = frame_shm_create(shm_name, SCREEN_WIDTH * factor, SCREEN_HEIGHT * factor, sizeof(uint32_t), shm_slots);
+    if (shm == NULL) {
+        printf("Error: failed to create shared memory frame ring %s.\n", shm_name);
+        exit(1);
+    }
+}
+
+static void shm_finish()
+{
+    if (shm == NULL)
+        return;
+    printf("Shared memory: %u frames published\n", frame_shm_published(shm));
+    frame_shm_destroy(shm);
+    shm = NULL;
+}
+
+/* The frame is converted straight into its slot, readers that are still
+   on an older frame are not waited for */
+static void shm_flip_display()
+{
+    upscale_convert_frame(shm_scale, PIXFMT_XRGB8888, front->frame[0], SCREEN_WIDTH, front->emphasis,
+                          frame_shm_begin(shm), SCREEN_WIDTH * upscale_factor(shm_scale) * sizeof(uint32_t),
+                          SCREEN_WIDTH, SCREEN_HEIGHT);
+    frame_shm_publish(shm);
+}
+
+const nes_hal_backend nes_hal_shm = {
+    "shm", shm_init, store_bg_color, store_scanline, shm_flip_display, frame_pacer_wait, no_keys, shm_finish
+};
+#endif
+
+
+
+// YATCPU Backend
+
+#ifdef YATCPU
 /* Initialization:
    (1) start a 1/FPS Hz timer. 
    (2) register fce_timer handle on each timer event */
-void nes_hal_init()
+static void yatcpu_init()
 {
-    for (int i = 0; i < 64; i ++) {
-        pal color = palette[i];
-        #ifdef RGB888
-        color_map[i] = packrgb(color.r, color.g, color.b);
-        #else
-        color_map[i] = rgb888to565(color.r, color.g, color.b);
-        #endif
-    }
-    #ifdef YATCPU
-    int *vram = ((int *) VRAM);
-    for (int y = 0; y < CANVAS_HEIGHT; ++y) {
-        for (int x = 0; x < left_border_end; ++x) {
-            vram[y * right_border_end + x] = 0;
-        }
-        for (int x = right_border_start; x < right_border_end; ++x) {
-            vram[y * right_border_end + x] = 0;
-        }
-    }
-    draw_frame_counter(32, 4);
+    // The first frame fills the borders, later ones only when the
+    // backdrop changes
+    canvas_draw_counter(CANVAS_PIXFMT, (void *) VRAM, CANVAS_X_OFFSET, 4, frames);
     // enable_interrupt();
     // *TIMER_LIMIT = REFRESH_TIMER_LIMIT;
     // *TIMER_ENABLED = 1;
+}
+
+/* Wait until next timer event is fired. */
+static void yatcpu_wait_for_frame()
+{
+    // timer_fired = 0;
+    // while(!timer_fired);
+}
+
+static void yatcpu_flip_display()
+{
+    compose_canvas((rgb *) VRAM);
+    ++frames;
+}
+
+const nes_hal_backend nes_hal_yatcpu = {
+    "yatcpu", yatcpu_init, store_bg_color, store_scanline, yatcpu_flip_display, yatcpu_wait_for_frame, no_keys, do_nothing
+};
+#endif
+
+
+
+// Backend Selection
+
+#if defined(YATCPU)
+static const nes_hal_backend *backend = &nes_hal_yatcpu;
+#elif defined(LITENES_DEBUG)
+static const nes_hal_backend *backend = &nes_hal_dump;
+#else
+static const nes_hal_backend *backend = &nes_hal_null;
+#endif
+
+void nes_set_hal_backend(const nes_hal_backend *b)
+{
+    backend = b;
+}
+
+#ifndef YATCPU
+const nes_hal_backend *nes_find_hal_backend(const char *name)
+{
+    static const nes_hal_backend *backends[] = { &nes_hal_null, &nes_hal_dump, &nes_hal_archive, &nes_hal_stream,
+                                                 &nes_hal_shm };
+    for (int i = 0; i < (int) (sizeof(backends) / sizeof(backends[0])); i++) {
+        if (strcmp(backends[i]->name, name) == 0)
+            return backends[i];
+    }
+    return NULL;
+}
+#endif
+
+void nes_hal_init()
+{
+    pixfmt_init();
+    upscale_init();
+    #ifndef YATCPU
+    screenshot_init();
     #endif
+    backend->init();
 }
 
-/* Update screen at FPS rate by allegro's drawing function. 
-   Timer ensures this function is called FPS times a second. */
+void nes_set_bg_color(int c)                                    { backend->set_bg_color(c); }
+void nes_flush_scanline(int y, const byte *line, int emphasis)  { backend->flush_scanline(y, line, emphasis); }
+void wait_for_frame()                                           { backend->wait_for_frame(); }
+int nes_key_state(int b)                                        { return backend->key_state(b); }
+
+
+
+
+// Frame Handoff
+
+#ifdef YATCPU
 void nes_flip_display()
 {
-    int bgc = bg_color;
-    draw_frame_counter(32, 4);
-    #ifdef YATCPU
-    int *fbuf = ((int *) frame_buffer);
-    int *vram = ((int *) VRAM);
-    #ifdef RGB888
-    #else
-    unsigned int bgcext = (bgc << 16) | bgc;
-    #endif
-    for (int y = 0; y < CANVAS_HEIGHT; ++y) {
-        for (int x = left_border_end; x < right_border_start; ++x) {
-            int i = y * right_border_end + x;
-            vram[i] = fbuf[i];
-            #ifdef RGB888
-            fbuf[i] = bgc;
-            #else
-            fbuf[i] = bgcext;
-            #endif
+    front->backdrop = bg_index;
+    backend->flip_display();
+}
+
+void nes_hal_finish()
+{
+    backend->finish();
+}
+#else
+// The buffer between back and front, with HANDOFF_FRESH set while it
+// holds a frame the presenter has not taken yet. Each side swaps its own
+// buffer for it with one atomic exchange, so neither ever waits for the
+// other: the emulator always has a free back buffer to draw the next
+// frame into, the presenter always gets the latest complete frame.
+#define HANDOFF_FRESH 4
+static atomic_uint handoff = 1;
+
+// Last frame handed over; only the emulator writes to it, after it has
+// come back round as the back buffer
+static index_buffer *completed = &index_buffers[1];
+
+static bool presenting;
+static atomic_bool present_stop;
+static sem_t present_wakeup;
+static pthread_t present_thread;
+static unsigned long frames_completed, frames_presented;
+
+/* Complete the back buffer and swap it for the one in the middle.
+   Scanlines the PPU did not flush this frame (frame cache, frame skip)
+   still hold whatever the buffer had three frames ago, so they are
+   brought up to date from the frame before. */
+static void hand_over_frame()
+{
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        if (!line_stored[y]) {
+            memcpy(back->frame[y], completed->frame[y], SCREEN_WIDTH);
+            back->emphasis[y] = completed->emphasis[y];
         }
+        line_stored[y] = false;
     }
-    ++frames;
-    #endif
-    #ifdef LITENES_DEBUG
-    char filename[32];
-    #ifdef RGB888
-    snprintf(filename, 32, "frame_%d.rgb888", frames);
-    #else
-    snprintf(filename, 32, "frame_%d.rgb565", frames);
-    #endif
-    FILE* fp = fopen(filename, "wb");
-    fwrite(frame_buffer, sizeof(frame_buffer), 1, fp);
-    fclose(fp);
-    int* fbuf = ((int*)frame_buffer);
-    for (int i = 0; i < CANVAS_HEIGHT * CANVAS_WIDTH / 2; ++i) {
-        fbuf[i] = bgc << 16 | bgc;
-    }
+    back->backdrop = bg_index;
+    completed = back;
+    frames_completed++;
+
+    unsigned middle = atomic_exchange_explicit(&handoff, (back - index_buffers) | HANDOFF_FRESH,
+                                               memory_order_acq_rel);
+    back = &index_buffers[middle & ~HANDOFF_FRESH];
+}
+
+/* Swap the front buffer for the latest frame, false if none is new */
+static bool take_frame()
+{
+    if (!(atomic_load_explicit(&handoff, memory_order_relaxed) & HANDOFF_FRESH))
+        return false;
+    unsigned middle = atomic_exchange_explicit(&handoff, front - index_buffers, memory_order_acq_rel);
+    front = &index_buffers[middle & ~HANDOFF_FRESH];
+    return true;
+}
 
-    if (frames >= EMU_FRAMES) {
-        exit(0);
+/* Present the latest frame each time the emulator has handed one over;
+   frames it hands over faster than they are presented are skipped */
+static void *present_main(void *arg)
+{
+    (void) arg;
+    while (!atomic_load_explicit(&present_stop, memory_order_acquire)) {
+        while (sem_wait(&present_wakeup) != 0)
+            ;
+        while (sem_trywait(&present_wakeup) == 0)
+            ;
+        if (take_frame()) {
+            backend->flip_display();
+            frames_presented++;
+        }
     }
-    ++frames;
-    printf("Emulating frame %d\n", frames);
-    #endif
+    return NULL;
 }
 
-/* Query a button's state.
-   Returns 1 if button #b is pressed. */
-int nes_key_state(int b)
+// A frame is encoded on the emulation thread right after it is handed
+// over, a few hundred microseconds at most (see screenshot.c)
+static const char *screenshot_prefix = "screenshot_";
+static screenshot_format screenshot_fmt = SCREENSHOT_PNG;
+static unsigned screenshot_interval;
+static volatile sig_atomic_t screenshot_requested;
+static bool screenshot_warned;
+
+void nes_set_screenshot_output(const char *prefix, screenshot_format format, unsigned interval)
 {
-    #ifdef YATCPU
-    #endif
-    return 0;
+    screenshot_prefix = prefix;
+    screenshot_fmt = format;
+    screenshot_interval = interval;
 }
 
+void nes_request_screenshot()
+{
+    screenshot_requested = 1;
+}
+
+static void take_screenshot()
+{
+    char path[256];
+
+    if (!screenshot_requested && (screenshot_interval == 0 || frames_completed % screenshot_interval != 0))
+        return;
+    screenshot_requested = 0;
+    snprintf(path, sizeof(path), "%s%lu%s", screenshot_prefix, frames_completed,
+             screenshot_extension(screenshot_fmt));
+    if (!screenshot_write(path, screenshot_fmt, completed->frame[0], completed->emphasis))
+        fprintf(stderr, "Error: failed to write screenshot %s.\n", path);
+}
+
+void nes_start_present_thread()
+{
+    sem_init(&present_wakeup, 0, 0);
+    presenting = pthread_create(&present_thread, NULL, present_main, NULL) == 0;
+}
+
+void nes_flip_display()
+{
+    // Backends that do not keep the scanlines have nothing to hand over
+    if (backend->flush_scanline == store_scanline) {
+        hand_over_frame();
+        take_screenshot();
+    }
+    else if ((screenshot_requested || screenshot_interval != 0) && !screenshot_warned) {
+        fprintf(stderr, "Warning: the %s backend keeps no frames to take screenshots of.\n", backend->name);
+        screenshot_warned = true;
+    }
+    if (presenting) {
+        // Only a wakeup, the presenter takes the frame whenever it is ready
+        sem_post(&present_wakeup);
+        return;
+    }
+    take_frame();
+    backend->flip_display();
+    frames_presented++;
+}
+
+void nes_hal_finish()
+{
+    if (presenting) {
+        // The last frame handed over is presented before the thread stops
+        atomic_store_explicit(&present_stop, true, memory_order_release);
+        sem_post(&present_wakeup);
+        pthread_join(present_thread, NULL);
+        if (take_frame()) {
+            backend->flip_display();
+            frames_presented++;
+        }
+        presenting = false;
+        fprintf(stderr, "Presenter: %lu of %lu frames presented\n", frames_presented, frames_completed);
+    }
+    backend->finish();
+}
+#endif
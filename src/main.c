@@ -11,13 +11,23 @@ How does the emulator work?
   2) load the rom file into array rom
   3) call fce_load_rom(rom) for parsing
   4) call fce_init for emulator initialization
-  5) call fce_run(), which is a non-exiting loop simulating the NES system
-  6) when SIGINT signal is received, it kills itself
+  5) call fce_run(), which is a loop simulating the NES system until the
+     HAL backend has output all it is going to
+  6) when SIGINT signal is received, it kills itself; SIGUSR1 takes a
+     screenshot of the next frame
 */
 
 #include "fce.h"
+#include "hal.h"
+#include "ppu.h"
 #ifdef YATCPU
 #include "mmio.h"
+#else
+#include "frame-writer.h"
+#include "frame-pacer.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
 #endif
 
 extern char rom[];
@@ -41,6 +51,45 @@ void delay(int count) {
   while(count--);
 }
 
+#ifndef YATCPU
+void wait_for_frame();
+
+// Emulates the given number of frames as fast as the HAL backend and the
+// frame pacer allow and reports the rate
+static void run_frames(unsigned long count)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (ppu_frame_count() < count && !nes_hal_done()) {
+      wait_for_frame();
+      fce_run_frame();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    count = ppu_frame_count();
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("%lu frames in %.3f s, %.1f fps\n", count, seconds, count / seconds);
+}
+
+static void request_screenshot(int sig)
+{
+    (void) sig;
+    nes_request_screenshot();
+}
+
+static void print_pacer_stats()
+{
+    frame_pacer_stats stats = frame_pacer_get_stats();
+    if (stats.frames == 0)
+      return;
+    fprintf(stderr, "Frame pacer: %lu frames at %.4f fps, %lu late, %lu resyncs\n",
+            stats.frames, stats.fps, stats.late, stats.resyncs);
+    fprintf(stderr, "Frame pacer: wake-up %.1f us mean, %.1f min, %.1f max, p50 < %ld, p99 < %ld, p99.9 < %ld\n",
+            stats.mean_ns / 1000, stats.min_ns / 1000.0, stats.max_ns / 1000.0,
+            stats.p50_ns / 1000, stats.p99_ns / 1000, stats.p999_ns / 1000);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
     #ifdef YATCPU 
@@ -86,12 +135,107 @@ int main(int argc, char *argv[])
     }
     #endif
     #ifdef LITENES_DEBUG
-      printf("ROM Loaded.\n");
+      fprintf(stderr, "ROM Loaded.\n");
+    #endif
+    #ifndef YATCPU
+    // LITENES_HAL=null|dump|archive|stream|shm picks the HAL backend, null
+    // does no frame output
+    if (getenv("LITENES_HAL")) {
+      const nes_hal_backend *backend = nes_find_hal_backend(getenv("LITENES_HAL"));
+      if (!backend) {
+        printf("Error: unknown HAL backend %s.\n", getenv("LITENES_HAL"));
+        return -1;
+      }
+      nes_set_hal_backend(backend);
+    }
+    // LITENES_DUMP_POLICY=drop skips frames the frame writer has no room
+    // for instead of waiting, in the dump and stream backends;
+    // LITENES_DUMP_STREAM=file dumps every frame into that one file
+    if (getenv("LITENES_DUMP_POLICY") && strcmp(getenv("LITENES_DUMP_POLICY"), "drop") == 0)
+      frame_writer_set_policy(FRAME_WRITER_DROP);
+    if (getenv("LITENES_DUMP_STREAM"))
+      frame_writer_set_stream(getenv("LITENES_DUMP_STREAM"));
+    // LITENES_ARCHIVE=file and LITENES_ARCHIVE_FRAMES=n set up the
+    // archive backend
+    if (getenv("LITENES_ARCHIVE") || getenv("LITENES_ARCHIVE_FRAMES"))
+      nes_set_archive_output(getenv("LITENES_ARCHIVE") ? getenv("LITENES_ARCHIVE") : "frames.lnfa",
+                             getenv("LITENES_ARCHIVE_FRAMES") ? atoi(getenv("LITENES_ARCHIVE_FRAMES")) : 601);
+    // LITENES_STREAM=y4m|y4m420|rgb24 sets the stream backend format and
+    // LITENES_STREAM_OUTPUT=file its output instead of stdout
+    if (getenv("LITENES_STREAM") || getenv("LITENES_STREAM_OUTPUT")) {
+      const char *format = getenv("LITENES_STREAM") ? getenv("LITENES_STREAM") : "y4m";
+      nes_set_stream_output(getenv("LITENES_STREAM_OUTPUT") ? getenv("LITENES_STREAM_OUTPUT") : "-",
+                            strcmp(format, "rgb24") == 0 ? VIDEO_STREAM_RGB24 :
+                            strcmp(format, "y4m420") == 0 ? VIDEO_STREAM_Y4M_420 : VIDEO_STREAM_Y4M);
+    }
+    // LITENES_SHM=name and LITENES_SHM_SLOTS=n set up the shm backend
+    if (getenv("LITENES_SHM") || getenv("LITENES_SHM_SLOTS"))
+      nes_set_shm_output(getenv("LITENES_SHM") ? getenv("LITENES_SHM") : "/litenes",
+                         getenv("LITENES_SHM_SLOTS") ? atoi(getenv("LITENES_SHM_SLOTS")) : 4);
+    // LITENES_SHM_SCALE=2x|3x|4x|scale2x scales the frames it publishes
+    if (getenv("LITENES_SHM_SCALE")) {
+      const char *scale = getenv("LITENES_SHM_SCALE");
+      nes_set_shm_scale(strcmp(scale, "2x") == 0 ? UPSCALE_2X :
+                        strcmp(scale, "3x") == 0 ? UPSCALE_3X :
+                        strcmp(scale, "4x") == 0 ? UPSCALE_4X :
+                        strcmp(scale, "scale2x") == 0 ? UPSCALE_SCALE2X : UPSCALE_NONE);
+    }
+    // LITENES_SCREENSHOT=png|png-stored|qoi picks the screenshot format,
+    // LITENES_SCREENSHOT_EVERY=n takes one of every n frames and
+    // LITENES_SCREENSHOT_PREFIX names the files; SIGUSR1 takes one any time
+    if (getenv("LITENES_SCREENSHOT") || getenv("LITENES_SCREENSHOT_EVERY") || getenv("LITENES_SCREENSHOT_PREFIX")) {
+      const char *format = getenv("LITENES_SCREENSHOT") ? getenv("LITENES_SCREENSHOT") : "png";
+      if (strcmp(format, "png") != 0 && strcmp(format, "png-stored") != 0 && strcmp(format, "qoi") != 0) {
+        printf("Error: unknown screenshot format %s.\n", format);
+        return -1;
+      }
+      nes_set_screenshot_output(getenv("LITENES_SCREENSHOT_PREFIX") ? getenv("LITENES_SCREENSHOT_PREFIX") : "screenshot_",
+                                strcmp(format, "qoi") == 0 ? SCREENSHOT_QOI :
+                                strcmp(format, "png-stored") == 0 ? SCREENSHOT_PNG_STORED : SCREENSHOT_PNG,
+                                getenv("LITENES_SCREENSHOT_EVERY") ? atoi(getenv("LITENES_SCREENSHOT_EVERY")) : 0);
+    }
+    signal(SIGUSR1, request_screenshot);
     #endif
     fce_init();
     #ifdef LITENES_DEBUG
-      printf("FCE initialized.\n");
+      fprintf(stderr, "FCE initialized.\n");
+    #endif
+    #ifndef YATCPU
+    // LITENES_FRAME_CACHE=1 reuses scanlines that have not changed since
+    // the previous frame instead of drawing them again
+    if (getenv("LITENES_FRAME_CACHE"))
+      ppu_set_frame_cache(true);
+    // LITENES_CATCH_UP=1 lets the PPU run lazily instead of per scanline
+    if (getenv("LITENES_CATCH_UP"))
+      ppu_set_catch_up(true);
+    // LITENES_RENDER_THREAD=1 draws frame N while frame N + 1 is emulated
+    if (getenv("LITENES_RENDER_THREAD"))
+      nes_start_render_thread();
+    // LITENES_PRESENT_THREAD=1 presents frames while the next is emulated
+    if (getenv("LITENES_PRESENT_THREAD"))
+      nes_start_present_thread();
+    // LITENES_FRAME_SKIP=n draws one frame in n + 1, -1 none
+    if (getenv("LITENES_FRAME_SKIP"))
+      ppu_set_frame_skip(atoi(getenv("LITENES_FRAME_SKIP")));
+    // LITENES_RENDER_BANDS=n draws each frame in n bands on n threads
+    if (getenv("LITENES_RENDER_BANDS"))
+      nes_start_band_rendering(atoi(getenv("LITENES_RENDER_BANDS")));
+    // LITENES_SPEED=n runs backends that present live at n times the NTSC
+    // frame rate, 0 unthrottled; LITENES_PACER_SPIN=us sets how long the
+    // pacer spins before each frame instead of sleeping
+    if (getenv("LITENES_SPEED"))
+      frame_pacer_set_speed(atof(getenv("LITENES_SPEED")));
+    if (getenv("LITENES_PACER_SPIN"))
+      frame_pacer_set_spin(atol(getenv("LITENES_PACER_SPIN")) * 1000);
+    atexit(print_pacer_stats);
+    // LITENES_FRAMES=n emulates n frames, prints the frame rate and exits
+    if (getenv("LITENES_FRAMES")) {
+      run_frames(atol(getenv("LITENES_FRAMES")));
+      nes_hal_finish();
+      return 0;
+    }
     #endif
     fce_run();
+    nes_hal_finish();
     return 0;
 }
@@ -0,0 +1,334 @@
+/*
+Palette conversion stage: turns frames of NES color codes into
+RGB565, RGB888 or XRGB8888 pixels.
+
+On x86 the converters are picked at run time:
+  - SSSE3: 64-entry lookups done as four 16-entry pshufb tables per
+    output byte plane, 16 pixels per iteration (all three formats, and
+    the byte tables of pixfmt_lookup_line).
+  - AVX2: XRGB8888 lookups done with 32-bit gathers, 8 pixels per
+    iteration.
+Every other target (including YATCPU) uses the scalar converters.
+
+Color emphasis costs nothing per pixel: every table exists once per
+emphasis bank and each line is converted with the tables of its bank.
+*/
+#include "pixfmt.h"
+#include "fce.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXFMT_X86
+#include <immintrin.h>
+#endif
+
+uint16_t pixfmt_rgb565[PIXFMT_BANKS][64];
+uint32_t pixfmt_xrgb8888[PIXFMT_BANKS][64];
+
+static void pixfmt_convert_rgb565_scalar(const byte *src, uint16_t *dst, int n, int bank);
+static void pixfmt_convert_xrgb8888_scalar(const byte *src, uint32_t *dst, int n, int bank);
+static void pixfmt_convert_rgb888_scalar(const byte *src, byte *dst, int n, int bank);
+
+static void (*pixfmt_convert_rgb565)(const byte *src, uint16_t *dst, int n, int bank) = pixfmt_convert_rgb565_scalar;
+static void (*pixfmt_convert_xrgb8888)(const byte *src, uint32_t *dst, int n, int bank) = pixfmt_convert_xrgb8888_scalar;
+static void (*pixfmt_convert_rgb888)(const byte *src, byte *dst, int n, int bank) = pixfmt_convert_rgb888_scalar;
+
+static void pixfmt_lookup_scalar(const byte *table, const byte *src, byte *dst, int n);
+static void (*pixfmt_lookup)(const byte *table, const byte *src, byte *dst, int n) = pixfmt_lookup_scalar;
+
+
+
+// Scalar Converters
+
+static void pixfmt_convert_rgb565_scalar(const byte *src, uint16_t *dst, int n, int bank)
+{
+    const uint16_t *table = pixfmt_rgb565[bank];
+    int i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        dst[i]     = table[src[i]     & 0x3F];
+        dst[i + 1] = table[src[i + 1] & 0x3F];
+        dst[i + 2] = table[src[i + 2] & 0x3F];
+        dst[i + 3] = table[src[i + 3] & 0x3F];
+    }
+    for (; i < n; i++)
+        dst[i] = table[src[i] & 0x3F];
+}
+
+static void pixfmt_convert_xrgb8888_scalar(const byte *src, uint32_t *dst, int n, int bank)
+{
+    const uint32_t *table = pixfmt_xrgb8888[bank];
+    int i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        dst[i]     = table[src[i]     & 0x3F];
+        dst[i + 1] = table[src[i + 1] & 0x3F];
+        dst[i + 2] = table[src[i + 2] & 0x3F];
+        dst[i + 3] = table[src[i + 3] & 0x3F];
+    }
+    for (; i < n; i++)
+        dst[i] = table[src[i] & 0x3F];
+}
+
+static void pixfmt_convert_rgb888_scalar(const byte *src, byte *dst, int n, int bank)
+{
+    const uint32_t *table = pixfmt_xrgb8888[bank];
+    int i;
+    for (i = 0; i < n; i++) {
+        dword c = table[src[i] & 0x3F];
+        dst[0] = c >> 16;
+        dst[1] = c >> 8;
+        dst[2] = c;
+        dst += 3;
+    }
+}
+
+static void pixfmt_lookup_scalar(const byte *table, const byte *src, byte *dst, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        dst[i] = table[src[i] & 0x3F];
+}
+
+
+
+// SIMD Converters
+
+#ifdef PIXFMT_X86
+
+// One output byte plane of the palette, split into four 16-entry tables
+typedef struct {
+    __m128i t[4];
+} pixfmt_plane;
+
+static pixfmt_plane pixfmt_plane_565_lo[PIXFMT_BANKS], pixfmt_plane_565_hi[PIXFMT_BANKS];
+static pixfmt_plane pixfmt_plane_b[PIXFMT_BANKS], pixfmt_plane_g[PIXFMT_BANKS], pixfmt_plane_r[PIXFMT_BANKS];
+
+// pshufb masks packing the R, G and B planes of 16 pixels into 48 bytes
+static pixfmt_plane pixfmt_pack_r, pixfmt_pack_g, pixfmt_pack_b;
+
+static void pixfmt_build_plane(pixfmt_plane *plane, const byte *bytes, int stride)
+{
+    byte tmp[64];
+    int i;
+    for (i = 0; i < 64; i++)
+        tmp[i] = bytes[i * stride];
+    for (i = 0; i < 4; i++)
+        plane->t[i] = _mm_loadu_si128((const __m128i *) &tmp[i * 16]);
+}
+
+// Looks up 16 color codes in a plane. q[k] holds the codes rebased to the
+// k-th quarter of the table, with bit 7 set in the lanes outside of it so
+// that pshufb zeroes them.
+#define PIXFMT_PLANE_LOOKUP(t, q) \
+    _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8((t)[0], (q)[0]), _mm_shuffle_epi8((t)[1], (q)[1])), \
+                 _mm_or_si128(_mm_shuffle_epi8((t)[2], (q)[2]), _mm_shuffle_epi8((t)[3], (q)[3])))
+
+__attribute__((target("ssse3")))
+static inline void pixfmt_split_codes(const byte *src, __m128i q[4])
+{
+    // (code ^ k << 4) is 0 - 15 inside the quarter and 16 - 63 outside,
+    // a saturating add of 0x70 moves the latter to 0x80 and above.
+    __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *) src), _mm_set1_epi8(0x3F));
+    __m128i bias = _mm_set1_epi8(0x70);
+    q[0] = _mm_adds_epu8(v, bias);
+    q[1] = _mm_adds_epu8(_mm_xor_si128(v, _mm_set1_epi8(0x10)), bias);
+    q[2] = _mm_adds_epu8(_mm_xor_si128(v, _mm_set1_epi8(0x20)), bias);
+    q[3] = _mm_adds_epu8(_mm_xor_si128(v, _mm_set1_epi8(0x30)), bias);
+}
+
+__attribute__((target("ssse3")))
+static void pixfmt_lookup_ssse3(const byte *table, const byte *src, byte *dst, int n)
+{
+    pixfmt_plane t;
+    int i;
+    pixfmt_build_plane(&t, table, 1);
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        pixfmt_split_codes(src + i, q);
+        _mm_storeu_si128((__m128i *) (dst + i), PIXFMT_PLANE_LOOKUP(t.t, q));
+    }
+    pixfmt_lookup_scalar(table, src + i, dst + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void pixfmt_convert_rgb565_ssse3(const byte *src, uint16_t *dst, int n, int bank)
+{
+    // Keep the tables in registers, the stores below may alias the globals
+    pixfmt_plane tl = pixfmt_plane_565_lo[bank], th = pixfmt_plane_565_hi[bank];
+    int i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        pixfmt_split_codes(src + i, q);
+        __m128i l = PIXFMT_PLANE_LOOKUP(tl.t, q);
+        __m128i h = PIXFMT_PLANE_LOOKUP(th.t, q);
+        _mm_storeu_si128((__m128i *) (dst + i),     _mm_unpacklo_epi8(l, h));
+        _mm_storeu_si128((__m128i *) (dst + i + 8), _mm_unpackhi_epi8(l, h));
+    }
+    pixfmt_convert_rgb565_scalar(src + i, dst + i, n - i, bank);
+}
+
+__attribute__((target("ssse3")))
+static void pixfmt_convert_xrgb8888_ssse3(const byte *src, uint32_t *dst, int n, int bank)
+{
+    pixfmt_plane tb = pixfmt_plane_b[bank], tg = pixfmt_plane_g[bank], tr = pixfmt_plane_r[bank];
+    __m128i zero = _mm_setzero_si128();
+    int i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        pixfmt_split_codes(src + i, q);
+        __m128i b = PIXFMT_PLANE_LOOKUP(tb.t, q);
+        __m128i g = PIXFMT_PLANE_LOOKUP(tg.t, q);
+        __m128i r = PIXFMT_PLANE_LOOKUP(tr.t, q);
+        __m128i bg_lo = _mm_unpacklo_epi8(b, g), bg_hi = _mm_unpackhi_epi8(b, g);
+        __m128i r0_lo = _mm_unpacklo_epi8(r, zero), r0_hi = _mm_unpackhi_epi8(r, zero);
+        _mm_storeu_si128((__m128i *) (dst + i),      _mm_unpacklo_epi16(bg_lo, r0_lo));
+        _mm_storeu_si128((__m128i *) (dst + i + 4),  _mm_unpackhi_epi16(bg_lo, r0_lo));
+        _mm_storeu_si128((__m128i *) (dst + i + 8),  _mm_unpacklo_epi16(bg_hi, r0_hi));
+        _mm_storeu_si128((__m128i *) (dst + i + 12), _mm_unpackhi_epi16(bg_hi, r0_hi));
+    }
+    pixfmt_convert_xrgb8888_scalar(src + i, dst + i, n - i, bank);
+}
+
+__attribute__((target("ssse3")))
+static void pixfmt_convert_rgb888_ssse3(const byte *src, byte *dst, int n, int bank)
+{
+    pixfmt_plane tb = pixfmt_plane_b[bank], tg = pixfmt_plane_g[bank], tr = pixfmt_plane_r[bank];
+    pixfmt_plane mr = pixfmt_pack_r, mg = pixfmt_pack_g, mb = pixfmt_pack_b;
+    int i, j;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        pixfmt_split_codes(src + i, q);
+        __m128i b = PIXFMT_PLANE_LOOKUP(tb.t, q);
+        __m128i g = PIXFMT_PLANE_LOOKUP(tg.t, q);
+        __m128i r = PIXFMT_PLANE_LOOKUP(tr.t, q);
+        for (j = 0; j < 3; j++) {
+            __m128i o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, mr.t[j]), _mm_shuffle_epi8(g, mg.t[j])),
+                                     _mm_shuffle_epi8(b, mb.t[j]));
+            _mm_storeu_si128((__m128i *) (dst + j * 16), o);
+        }
+        dst += 48;
+    }
+    pixfmt_convert_rgb888_scalar(src + i, dst, n - i, bank);
+}
+
+__attribute__((target("avx2")))
+static void pixfmt_convert_xrgb8888_avx2(const byte *src, uint32_t *dst, int n, int bank)
+{
+    const int *table = (const int *) pixfmt_xrgb8888[bank];
+    int i;
+    __m256i mask = _mm256_set1_epi32(0x3F);
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + i))), mask);
+        __m256i px = _mm256_i32gather_epi32(table, idx, 4);
+        _mm256_storeu_si256((__m256i *) (dst + i), px);
+    }
+    pixfmt_convert_xrgb8888_scalar(src + i, dst + i, n - i, bank);
+}
+
+static void pixfmt_init_simd()
+{
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("ssse3"))
+        return;
+
+    int bank, j;
+    for (bank = 0; bank < PIXFMT_BANKS; bank++) {
+        pixfmt_build_plane(&pixfmt_plane_565_lo[bank], (const byte *) pixfmt_rgb565[bank], 2);
+        pixfmt_build_plane(&pixfmt_plane_565_hi[bank], (const byte *) pixfmt_rgb565[bank] + 1, 2);
+        pixfmt_build_plane(&pixfmt_plane_b[bank], (const byte *) pixfmt_xrgb8888[bank], 4);
+        pixfmt_build_plane(&pixfmt_plane_g[bank], (const byte *) pixfmt_xrgb8888[bank] + 1, 4);
+        pixfmt_build_plane(&pixfmt_plane_r[bank], (const byte *) pixfmt_xrgb8888[bank] + 2, 4);
+    }
+
+    // Output byte j takes channel j % 3 of pixel j / 3
+    byte m[3][64] = { { 0 } };
+    for (j = 0; j < 48; j++) {
+        m[0][j] = j % 3 == 0 ? j / 3 : 0x80;
+        m[1][j] = j % 3 == 1 ? j / 3 : 0x80;
+        m[2][j] = j % 3 == 2 ? j / 3 : 0x80;
+    }
+    pixfmt_build_plane(&pixfmt_pack_r, m[0], 1);
+    pixfmt_build_plane(&pixfmt_pack_g, m[1], 1);
+    pixfmt_build_plane(&pixfmt_pack_b, m[2], 1);
+
+    pixfmt_convert_rgb565 = pixfmt_convert_rgb565_ssse3;
+    pixfmt_convert_xrgb8888 = pixfmt_convert_xrgb8888_ssse3;
+    pixfmt_convert_rgb888 = pixfmt_convert_rgb888_ssse3;
+    pixfmt_lookup = pixfmt_lookup_ssse3;
+    if (__builtin_cpu_supports("avx2"))
+        pixfmt_convert_xrgb8888 = pixfmt_convert_xrgb8888_avx2;
+}
+
+#endif
+
+
+
+// Public Interface
+
+// Emphasis dims every channel whose own bit is clear while another one is
+// set, all three when every bit is set
+static byte pixfmt_emphasize(byte value, int bank, int channel)
+{
+    if (bank == PIXFMT_BANKS - 1)
+        return value * 3 / 4;
+    return bank && !(bank & (1 << channel)) ? value * 3 / 4 : value;
+}
+
+void pixfmt_init()
+{
+    int bank, i;
+    for (bank = 0; bank < PIXFMT_BANKS; bank++) {
+        for (i = 0; i < 64; i++) {
+            byte r = pixfmt_emphasize(palette[i].r, bank, 0);
+            byte g = pixfmt_emphasize(palette[i].g, bank, 1);
+            byte b = pixfmt_emphasize(palette[i].b, bank, 2);
+            pixfmt_rgb565[bank][i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            pixfmt_xrgb8888[bank][i] = (r << 16) | (g << 8) | b;
+        }
+    }
+#ifdef PIXFMT_X86
+    pixfmt_init_simd();
+#endif
+}
+
+void pixfmt_disable_simd()
+{
+    pixfmt_convert_rgb565 = pixfmt_convert_rgb565_scalar;
+    pixfmt_convert_xrgb8888 = pixfmt_convert_xrgb8888_scalar;
+    pixfmt_convert_rgb888 = pixfmt_convert_rgb888_scalar;
+    pixfmt_lookup = pixfmt_lookup_scalar;
+}
+
+int pixfmt_bytes_per_pixel(pixfmt fmt)
+{
+    switch (fmt) {
+        case PIXFMT_RGB565: return 2;
+        case PIXFMT_RGB888: return 3;
+        default: return 4;
+    }
+}
+
+void pixfmt_convert_line(pixfmt fmt, const byte *src, void *dst, int n, int bank)
+{
+    bank &= PIXFMT_BANKS - 1;
+    switch (fmt) {
+        case PIXFMT_RGB565: pixfmt_convert_rgb565(src, (uint16_t *) dst, n, bank); break;
+        case PIXFMT_RGB888: pixfmt_convert_rgb888(src, (byte *) dst, n, bank); break;
+        case PIXFMT_XRGB8888: pixfmt_convert_xrgb8888(src, (uint32_t *) dst, n, bank); break;
+    }
+}
+
+void pixfmt_convert_frame(pixfmt fmt, const byte *src, int src_pitch, const byte *banks,
+                          void *dst, int dst_pitch, int width, int height)
+{
+    byte *out = (byte *) dst;
+    int y;
+    for (y = 0; y < height; y++) {
+        pixfmt_convert_line(fmt, src, out, width, banks ? banks[y] : 0);
+        src += src_pitch;
+        out += dst_pitch;
+    }
+}
+
+void pixfmt_lookup_line(const byte *table, const byte *src, byte *dst, int n)
+{
+    pixfmt_lookup(table, src, dst, n);
+}
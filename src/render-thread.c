@@ -0,0 +1,132 @@
+/*
+Pipelined rendering: the emulation thread records frame N into one frame
+packet while a render thread draws frame N - 1 from the other. The two
+threads only share a single packet slot, handed back and forth with a
+pair of semaphores, so neither spins while it waits for the other.
+
+Band rendering: the scanlines of each packet are split into as many bands
+as there are threads in a fixed pool, the thread that renders the packet
+included. It draws band 0 itself and waits for the others before the
+frame is presented. Each pool thread sleeps on a semaphore of its own
+between frames. Works with or without the render thread.
+*/
+#include "hal.h"
+#include "ppu.h"
+
+#ifdef YATCPU
+
+// Single core: packets are drawn as soon as they are submitted
+void nes_submit_frame_packet(ppu_frame_packet *packet)
+{
+    ppu_render_packet(packet);
+}
+
+#else
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+#define MAX_BANDS 16
+
+// Packet waiting for or being drawn by the render thread. render_ready
+// is posted when it is filled, render_idle when it has been drawn.
+static ppu_frame_packet *render_slot;
+static sem_t render_ready, render_idle;
+static pthread_t render_thread;
+static bool render_threaded;
+
+static void render_wait(sem_t *sem)
+{
+    while (sem_wait(sem) != 0)
+        ;
+}
+
+// Pool thread n waits for band_start[n], draws its band of band_packet
+// and posts bands_done
+static int band_count = 1;
+static pthread_t band_threads[MAX_BANDS];
+static ppu_frame_packet *band_packet;
+static sem_t band_start[MAX_BANDS];
+static sem_t bands_done;
+
+static void *band_thread_main(void *arg)
+{
+    int band = (int) (intptr_t) arg;
+
+    for (;;) {
+        render_wait(&band_start[band]);
+        ppu_render_band(band_packet, band, band_count);
+        sem_post(&bands_done);
+    }
+    return NULL;
+}
+
+static void render_packet(ppu_frame_packet *packet)
+{
+    if (band_count == 1 || !ppu_prepare_bands(packet)) {
+        ppu_render_packet(packet);
+        return;
+    }
+
+    int band;
+    band_packet = packet;
+    for (band = 1; band < band_count; band++)
+        sem_post(&band_start[band]);
+
+    ppu_render_band(packet, 0, band_count);
+    for (band = 1; band < band_count; band++)
+        render_wait(&bands_done);
+
+    ppu_finish_bands(packet);
+}
+
+static void *render_thread_main(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        render_wait(&render_ready);
+        render_packet(render_slot);
+        sem_post(&render_idle);
+    }
+    return NULL;
+}
+
+void nes_start_render_thread()
+{
+    sem_init(&render_ready, 0, 0);
+    sem_init(&render_idle, 0, 1);
+    if (pthread_create(&render_thread, NULL, render_thread_main, NULL) == 0) {
+        render_threaded = true;
+        ppu_set_pipelined(true);
+    }
+}
+
+void nes_start_band_rendering(int threads)
+{
+    if (threads > MAX_BANDS)
+        threads = MAX_BANDS;
+
+    sem_init(&bands_done, 0, 0);
+    for (band_count = 1; band_count < threads; band_count++)
+        if (sem_init(&band_start[band_count], 0, 0) != 0 ||
+            pthread_create(&band_threads[band_count], NULL, band_thread_main, (void *) (intptr_t) band_count) != 0)
+            break;
+
+    ppu_set_pipelined(true);
+}
+
+void nes_submit_frame_packet(ppu_frame_packet *packet)
+{
+    if (!render_threaded) {
+        render_packet(packet);
+        return;
+    }
+
+    // Once the previous packet is drawn the slot may be refilled
+    render_wait(&render_idle);
+    render_slot = packet;
+    sem_post(&render_ready);
+}
+
+#endif
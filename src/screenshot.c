@@ -0,0 +1,496 @@
+/*
+Screenshot encoding, see screenshot.h.
+
+A PNG frame is indexed color whenever it can be: each emphasis bank the
+frame uses gets 64 palette entries, so a row of color codes turns into
+a row of palette indices with one pixfmt_lookup_line() call, and the
+image data is a quarter of the RGB size before it is compressed. The
+compressor is a single greedy LZ77 pass with a hash table of the last
+position each 4 bytes were seen at, and the fixed Huffman codes of
+deflate, so there are no code tables to build or send. NES frames,
+with their runs of one color and rows repeating the row above, come out
+at a few kilobytes.
+
+QOI needs no palette: each color code is looked up in a table of the
+packed RGB values and QOI hashes of its bank, and the encoder runs over
+those.
+*/
+#ifndef YATCPU
+
+#include "screenshot.h"
+#include "nes.h"
+#include "pixfmt.h"
+
+#include <stdio.h>
+
+// Palette entries for at most this many banks in an indexed PNG
+#define SCREENSHOT_PALETTE_BANKS 4
+
+// Image data of a PNG: each row is a filter type byte and the pixels
+#define SCREENSHOT_ROW_INDEXED (1 + SCREEN_WIDTH)
+#define SCREENSHOT_ROW_RGB (1 + SCREEN_WIDTH * 3)
+#define SCREENSHOT_RAW_MAX (SCREEN_HEIGHT * SCREENSHOT_ROW_RGB)
+
+// Signature, IHDR, the largest PLTE, IDAT with the zlib header and
+// checksum, IEND
+#define SCREENSHOT_PNG_OVERHEAD (8 + 25 + 12 + 3 * 64 * SCREENSHOT_PALETTE_BANKS + 12 + 6 + 12)
+#define SCREENSHOT_STORED_BLOCK 65535
+
+// A literal takes at most 9 bits, a match of at least 4 bytes at most 31
+#define SCREENSHOT_PNG_MAX (SCREENSHOT_PNG_OVERHEAD + SCREENSHOT_RAW_MAX / 8 * 9 + 16)
+#define SCREENSHOT_PNG_STORED_MAX (SCREENSHOT_PNG_OVERHEAD + SCREENSHOT_RAW_MAX + \
+                                   5 * (SCREENSHOT_RAW_MAX / SCREENSHOT_STORED_BLOCK + 1))
+#define SCREENSHOT_QOI_MAX (14 + SCREEN_WIDTH * SCREEN_HEIGHT * 4 + 8)
+
+#define SCREENSHOT_HASH_BITS 13
+#define SCREENSHOT_WINDOW 32768
+#define SCREENSHOT_MAX_MATCH 258
+
+// CRC-32 of one byte, and slicing tables to take eight at once
+static uint32_t crc_table[8][256];
+
+// Palette index of each color code, per bank slot of an indexed PNG
+static byte slot_codes[SCREENSHOT_PALETTE_BANKS][64];
+
+// Opaque 0xAARRGGBB colors and their QOI hashes
+static uint32_t qoi_colors[PIXFMT_BANKS][64];
+static byte qoi_hashes[PIXFMT_BANKS][64];
+
+// Fixed Huffman codes, bit reversed for the LSB first bit stream: literal
+// bytes, and length codes with their extra bits appended
+static uint16_t literal_codes[256];
+static byte literal_bits[256];
+static uint32_t length_codes[SCREENSHOT_MAX_MATCH + 1];
+static byte length_bits[SCREENSHOT_MAX_MATCH + 1];
+static byte distance_codes[30];
+
+static byte raw[SCREENSHOT_RAW_MAX];
+static uint32_t head[1 << SCREENSHOT_HASH_BITS];
+static byte image[SCREENSHOT_QOI_MAX > SCREENSHOT_PNG_MAX ? SCREENSHOT_QOI_MAX : SCREENSHOT_PNG_MAX];
+
+static unsigned reverse_bits(unsigned code, int n)
+{
+    unsigned result = 0;
+    while (n--) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+void screenshot_init()
+{
+    static const int length_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const int length_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    unsigned c;
+    int i, k, bank;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 8; k++)
+            crc_table[k][i] = crc_table[0][crc_table[k - 1][i] & 0xFF] ^ (crc_table[k - 1][i] >> 8);
+
+    for (k = 0; k < SCREENSHOT_PALETTE_BANKS; k++)
+        for (i = 0; i < 64; i++)
+            slot_codes[k][i] = k * 64 + i;
+
+    for (bank = 0; bank < PIXFMT_BANKS; bank++) {
+        for (i = 0; i < 64; i++) {
+            uint32_t color = pixfmt_xrgb8888[bank][i];
+            int r = (color >> 16) & 0xFF, g = (color >> 8) & 0xFF, b = color & 0xFF;
+            qoi_colors[bank][i] = 0xFF000000 | color;
+            qoi_hashes[bank][i] = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+        }
+    }
+
+    // Literals 0 - 143 are 8 bit codes from 0x30, 144 - 255 9 bit codes
+    // from 0x190; length symbols 257 - 279 are 7 bit codes from 1, 280 -
+    // 285 8 bit codes from 0xC0
+    for (i = 0; i < 256; i++) {
+        literal_bits[i] = i < 144 ? 8 : 9;
+        literal_codes[i] = reverse_bits(i < 144 ? 0x30 + i : 0x190 + i - 144, literal_bits[i]);
+    }
+    for (k = 0; k < 29; k++) {
+        int symbol = 257 + k;
+        int bits = symbol < 280 ? 7 : 8;
+        unsigned code = reverse_bits(symbol < 280 ? symbol - 256 : 0xC0 + symbol - 280, bits);
+        int end = k < 28 ? length_base[k + 1] : SCREENSHOT_MAX_MATCH + 1;
+        for (i = length_base[k]; i < end; i++) {
+            length_codes[i] = code | (i - length_base[k]) << bits;
+            length_bits[i] = bits + length_extra[k];
+        }
+    }
+    for (k = 0; k < 30; k++)
+        distance_codes[k] = reverse_bits(k, 5);
+}
+
+const char *screenshot_extension(screenshot_format format)
+{
+    return format == SCREENSHOT_QOI ? ".qoi" : ".png";
+}
+
+size_t screenshot_max_size(screenshot_format format)
+{
+    switch (format) {
+        case SCREENSHOT_PNG: return SCREENSHOT_PNG_MAX;
+        case SCREENSHOT_PNG_STORED: return SCREENSHOT_PNG_STORED_MAX;
+        default: return SCREENSHOT_QOI_MAX;
+    }
+}
+
+static byte *put_be32(byte *out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+    return out + 4;
+}
+
+static uint32_t load32(const byte *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+
+
+// Deflate
+
+typedef struct {
+    byte *out;
+    uint64_t bits;
+    int count;
+} bit_writer;
+
+// Appends n (up to 31) bits, LSB first
+static inline void put_bits(bit_writer *w, uint32_t value, int n)
+{
+    w->bits |= (uint64_t) value << w->count;
+    w->count += n;
+    if (w->count >= 32) {
+        w->out[0] = w->bits;
+        w->out[1] = w->bits >> 8;
+        w->out[2] = w->bits >> 16;
+        w->out[3] = w->bits >> 24;
+        w->out += 4;
+        w->bits >>= 32;
+        w->count -= 32;
+    }
+}
+
+static inline void put_distance(bit_writer *w, unsigned distance)
+{
+    unsigned d = distance - 1;
+    if (d < 4) {
+        put_bits(w, distance_codes[d], 5);
+        return;
+    }
+    int log = 31 - __builtin_clz(d);
+    int extra = log - 1;
+    int symbol = 2 * log + ((d >> extra) & 1);
+    put_bits(w, distance_codes[symbol] | (d & ((1u << extra) - 1)) << 5, 5 + extra);
+}
+
+// One fixed Huffman block holding all of src
+static byte *deflate_fixed(const byte *src, size_t n, byte *out)
+{
+    bit_writer w = { out, 0, 0 };
+    size_t i = 0;
+
+    memset(head, 0, sizeof(head));
+    put_bits(&w, 1 | 1 << 1, 3);
+    while (i + 4 <= n) {
+        uint32_t sequence = load32(src + i);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - SCREENSHOT_HASH_BITS);
+        size_t candidate = head[hash];
+        head[hash] = i + 1;
+
+        // Positions are stored plus one, 0 is an empty entry
+        if (candidate != 0 && i + 1 - candidate <= SCREENSHOT_WINDOW &&
+            load32(src + candidate - 1) == sequence) {
+            const byte *match = src + candidate - 1;
+            size_t max = n - i < SCREENSHOT_MAX_MATCH ? n - i : SCREENSHOT_MAX_MATCH;
+            size_t length = 4;
+            while (length < max && match[length] == src[i + length])
+                length++;
+            put_bits(&w, length_codes[length], length_bits[length]);
+            put_distance(&w, src + i - match);
+            i += length;
+        } else {
+            put_bits(&w, literal_codes[src[i]], literal_bits[src[i]]);
+            i++;
+        }
+    }
+    for (; i < n; i++)
+        put_bits(&w, literal_codes[src[i]], literal_bits[src[i]]);
+
+    // End of block, symbol 256, is seven zero bits
+    put_bits(&w, 0, 7);
+    while (w.count > 0) {
+        *w.out++ = w.bits;
+        w.bits >>= 8;
+        w.count -= 8;
+    }
+    return w.out;
+}
+
+static byte *deflate_stored(const byte *src, size_t n, byte *out)
+{
+    do {
+        size_t length = n < SCREENSHOT_STORED_BLOCK ? n : SCREENSHOT_STORED_BLOCK;
+        n -= length;
+        *out++ = n == 0;
+        out[0] = length;
+        out[1] = length >> 8;
+        out[2] = ~length;
+        out[3] = ~length >> 8;
+        memcpy(out + 4, src, length);
+        out += 4 + length;
+        src += length;
+    } while (n > 0);
+    return out;
+}
+
+static uint32_t adler32(const byte *p, size_t n)
+{
+    uint32_t a = 1, b = 0;
+    while (n > 0) {
+        // The most bytes before b can overflow
+        size_t k = n < 5552 ? n : 5552;
+        n -= k;
+        while (k--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+
+
+// PNG
+
+static uint32_t crc32(const byte *p, size_t n)
+{
+    uint32_t c = 0xFFFFFFFF;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        c = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+            crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+    }
+    while (n--)
+        c = crc_table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+// A chunk starts with its length, which is filled in at the end
+static byte *chunk_begin(byte *chunk, const char *type)
+{
+    memcpy(chunk + 4, type, 4);
+    return chunk + 8;
+}
+
+static byte *chunk_end(byte *chunk, byte *end)
+{
+    put_be32(chunk, end - chunk - 8);
+    return put_be32(end, crc32(chunk + 4, end - chunk - 4));
+}
+
+static size_t encode_png(bool compress, const byte *frame, const byte *banks, byte *out)
+{
+    static const byte signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    int slots[PIXFMT_BANKS];
+    int used[SCREENSHOT_PALETTE_BANKS];
+    int n = 0, y, i, k;
+    bool indexed = true;
+
+    for (i = 0; i < PIXFMT_BANKS; i++)
+        slots[i] = -1;
+    for (y = 0; y < SCREEN_HEIGHT && indexed; y++) {
+        int bank = banks ? banks[y] & (PIXFMT_BANKS - 1) : 0;
+        if (slots[bank] >= 0)
+            continue;
+        if (n == SCREENSHOT_PALETTE_BANKS)
+            indexed = false;
+        else
+            used[slots[bank] = n++] = bank;
+    }
+
+    byte *p = out, *chunk;
+    memcpy(p, signature, 8);
+    p += 8;
+
+    chunk = p;
+    p = chunk_begin(chunk, "IHDR");
+    p = put_be32(p, SCREEN_WIDTH);
+    p = put_be32(p, SCREEN_HEIGHT);
+    *p++ = 8;                // bits per sample
+    *p++ = indexed ? 3 : 2;  // indexed or RGB color
+    *p++ = 0;                // deflate
+    *p++ = 0;                // the adaptive filters
+    *p++ = 0;                // not interlaced
+    p = chunk_end(chunk, p);
+
+    size_t length;
+    if (indexed) {
+        chunk = p;
+        p = chunk_begin(chunk, "PLTE");
+        for (k = 0; k < n; k++) {
+            for (i = 0; i < 64; i++) {
+                uint32_t color = pixfmt_xrgb8888[used[k]][i];
+                *p++ = color >> 16;
+                *p++ = color >> 8;
+                *p++ = color;
+            }
+        }
+        p = chunk_end(chunk, p);
+
+        // Filter type 0, none, is the one that suits indexed color
+        for (y = 0; y < SCREEN_HEIGHT; y++) {
+            byte *row = raw + y * SCREENSHOT_ROW_INDEXED;
+            int bank = banks ? banks[y] & (PIXFMT_BANKS - 1) : 0;
+            row[0] = 0;
+            pixfmt_lookup_line(slot_codes[slots[bank]], frame + y * SCREEN_WIDTH, row + 1, SCREEN_WIDTH);
+        }
+        length = SCREEN_HEIGHT * SCREENSHOT_ROW_INDEXED;
+    } else {
+        for (y = 0; y < SCREEN_HEIGHT; y++) {
+            byte *row = raw + y * SCREENSHOT_ROW_RGB;
+            row[0] = 0;
+            pixfmt_convert_line(PIXFMT_RGB888, frame + y * SCREEN_WIDTH, row + 1, SCREEN_WIDTH,
+                                banks ? banks[y] : 0);
+        }
+        length = SCREEN_HEIGHT * SCREENSHOT_ROW_RGB;
+    }
+
+    chunk = p;
+    p = chunk_begin(chunk, "IDAT");
+    *p++ = 0x78;  // deflate, 32K window
+    *p++ = 0x01;  // no dictionary, fastest level, header check bits
+    p = compress ? deflate_fixed(raw, length, p) : deflate_stored(raw, length, p);
+    p = put_be32(p, adler32(raw, length));
+    p = chunk_end(chunk, p);
+
+    chunk = p;
+    p = chunk_end(chunk, chunk_begin(chunk, "IEND"));
+    return p - out;
+}
+
+
+
+// QOI
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+
+static size_t encode_qoi(const byte *frame, const byte *banks, byte *out)
+{
+    // Colors seen, by hash; zero is transparent black, which never matches
+    uint32_t seen[64] = { 0 };
+    uint32_t previous = 0xFF000000;
+    int run = 0, x, y;
+    byte *p = out;
+
+    memcpy(p, "qoif", 4);
+    p = put_be32(p + 4, SCREEN_WIDTH);
+    p = put_be32(p, SCREEN_HEIGHT);
+    *p++ = 3;  // RGB
+    *p++ = 0;  // sRGB with linear alpha
+
+    for (y = 0; y < SCREEN_HEIGHT; y++) {
+        int bank = banks ? banks[y] & (PIXFMT_BANKS - 1) : 0;
+        const uint32_t *colors = qoi_colors[bank];
+        const byte *hashes = qoi_hashes[bank];
+        const byte *row = frame + y * SCREEN_WIDTH;
+
+        for (x = 0; x < SCREEN_WIDTH; x++) {
+            int code = row[x] & 0x3F;
+            uint32_t color = colors[code];
+            if (color == previous) {
+                if (++run == 62) {
+                    *p++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            int hash = hashes[code];
+            if (seen[hash] == color) {
+                *p++ = QOI_OP_INDEX | hash;
+            } else {
+                seen[hash] = color;
+                signed char dr = ((color >> 16) & 0xFF) - ((previous >> 16) & 0xFF);
+                signed char dg = ((color >> 8) & 0xFF) - ((previous >> 8) & 0xFF);
+                signed char db = (color & 0xFF) - (previous & 0xFF);
+                signed char dr_dg = dr - dg, db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    *p++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    *p++ = QOI_OP_LUMA | (dg + 32);
+                    *p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+                } else {
+                    *p++ = QOI_OP_RGB;
+                    *p++ = color >> 16;
+                    *p++ = color >> 8;
+                    *p++ = color;
+                }
+            }
+            previous = color;
+        }
+    }
+    if (run > 0)
+        *p++ = QOI_OP_RUN | (run - 1);
+
+    // End marker
+    memset(p, 0, 7);
+    p[7] = 1;
+    return p + 8 - out;
+}
+
+
+
+// Encoding
+
+size_t screenshot_encode(screenshot_format format, const byte *frame, const byte *banks, byte *out)
+{
+    switch (format) {
+        case SCREENSHOT_PNG: return encode_png(true, frame, banks, out);
+        case SCREENSHOT_PNG_STORED: return encode_png(false, frame, banks, out);
+        default: return encode_qoi(frame, banks, out);
+    }
+}
+
+bool screenshot_write(const char *path, screenshot_format format, const byte *frame, const byte *banks)
+{
+    size_t length = screenshot_encode(format, frame, banks, image);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    bool written = fwrite(image, 1, length, file) == length;
+    return fclose(file) == 0 && written;
+}
+
+#endif
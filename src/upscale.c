@@ -0,0 +1,429 @@
+/*
+Output scaling stage, see upscale.h.
+
+Each source row is converted by pixfmt into a line buffer, padded with
+a copy of its edge pixels, and scaled from there into the destination:
+RGB565 in 16-bit lanes, RGB888 and XRGB8888 in 32-bit lanes, RGB888
+packed to three bytes per pixel as it is stored. scale2x keeps the rows
+above and below in two more line buffers. The destination is written
+once, front to back, and never read.
+
+On x86 with SSSE3 the scalers take a vector of source pixels at a time:
+  - nearest neighbour: one pshufb per destination vector widens the
+    pixels (and packs them for RGB888), and each destination vector is
+    stored on all of the destination rows.
+  - scale2x: the pixels are compared with their four neighbours, loaded
+    from the line buffers one pixel apart, and the EPX rules become
+    masks that blend in the neighbours.
+Every other target (including YATCPU) uses the scalar scalers.
+*/
+#include "upscale.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UPSCALE_X86
+#include <immintrin.h>
+#endif
+
+// Line buffer padding on either side, in 32-bit words
+#define UPSCALE_PAD 8
+
+static uint32_t upscale_lines[3][UPSCALE_MAX_WIDTH + 2 * UPSCALE_PAD];
+
+
+
+// Scalar Scalers
+
+// The EPX rules: a corner takes the color of the two neighbours next to
+// it when they match and the other two do not
+#define UPSCALE_EPX(a, b, c, d, p, e) \
+    do { \
+        e[0] = (c == a && c != d && a != b) ? a : p; \
+        e[1] = (a == b && a != c && b != d) ? b : p; \
+        e[2] = (d == c && d != b && c != a) ? c : p; \
+        e[3] = (b == d && b != a && d != c) ? d : p; \
+    } while (0)
+
+static inline void upscale_put32(byte *dst, uint32_t px, bool packed)
+{
+    if (packed) {
+        dst[0] = px >> 16;
+        dst[1] = px >> 8;
+        dst[2] = px;
+    }
+    else {
+        memcpy(dst, &px, 4);
+    }
+}
+
+// The scalers write pixels from..width - 1 of a source row, dst is where
+// the first of its destination rows starts
+static void upscale_nearest16_scalar(const uint16_t *line, byte *dst, int pitch, int from, int width, int factor)
+{
+    int x, k, r;
+    for (r = 0; r < factor; r++) {
+        uint16_t *out = (uint16_t *) (dst + r * pitch);
+        for (x = from; x < width; x++)
+            for (k = 0; k < factor; k++)
+                out[x * factor + k] = line[x];
+    }
+}
+
+static void upscale_nearest32_scalar(const uint32_t *line, byte *dst, int pitch, int from, int width, int factor,
+                                     bool packed)
+{
+    int bpp = packed ? 3 : 4;
+    int x, k, r;
+    for (r = 0; r < factor; r++) {
+        byte *out = dst + r * pitch;
+        for (x = from; x < width; x++)
+            for (k = 0; k < factor; k++)
+                upscale_put32(out + (x * factor + k) * bpp, line[x], packed);
+    }
+}
+
+static void upscale_scale2x16_scalar(const uint16_t *above, const uint16_t *line, const uint16_t *below,
+                                     byte *dst, int pitch, int from, int width)
+{
+    uint16_t *top = (uint16_t *) dst, *bottom = (uint16_t *) (dst + pitch);
+    uint16_t e[4];
+    int x;
+    for (x = from; x < width; x++) {
+        UPSCALE_EPX(above[x], line[x + 1], line[x - 1], below[x], line[x], e);
+        top[2 * x] = e[0];
+        top[2 * x + 1] = e[1];
+        bottom[2 * x] = e[2];
+        bottom[2 * x + 1] = e[3];
+    }
+}
+
+static void upscale_scale2x32_scalar(const uint32_t *above, const uint32_t *line, const uint32_t *below,
+                                     byte *dst, int pitch, int from, int width, bool packed)
+{
+    int bpp = packed ? 3 : 4;
+    uint32_t e[4];
+    int x;
+    for (x = from; x < width; x++) {
+        UPSCALE_EPX(above[x], line[x + 1], line[x - 1], below[x], line[x], e);
+        upscale_put32(dst + 2 * x * bpp, e[0], packed);
+        upscale_put32(dst + (2 * x + 1) * bpp, e[1], packed);
+        upscale_put32(dst + pitch + 2 * x * bpp, e[2], packed);
+        upscale_put32(dst + pitch + (2 * x + 1) * bpp, e[3], packed);
+    }
+}
+
+static void upscale_nearest16_all_scalar(const uint16_t *line, byte *dst, int pitch, int width, int factor)
+{
+    upscale_nearest16_scalar(line, dst, pitch, 0, width, factor);
+}
+
+static void upscale_nearest32_all_scalar(const uint32_t *line, byte *dst, int pitch, int width, int factor,
+                                         bool packed)
+{
+    upscale_nearest32_scalar(line, dst, pitch, 0, width, factor, packed);
+}
+
+static void upscale_scale2x16_all_scalar(const uint16_t *above, const uint16_t *line, const uint16_t *below,
+                                         byte *dst, int pitch, int width)
+{
+    upscale_scale2x16_scalar(above, line, below, dst, pitch, 0, width);
+}
+
+static void upscale_scale2x32_all_scalar(const uint32_t *above, const uint32_t *line, const uint32_t *below,
+                                         byte *dst, int pitch, int width, bool packed)
+{
+    upscale_scale2x32_scalar(above, line, below, dst, pitch, 0, width, packed);
+}
+
+static void (*upscale_nearest16)(const uint16_t *line, byte *dst, int pitch, int width, int factor) =
+    upscale_nearest16_all_scalar;
+static void (*upscale_nearest32)(const uint32_t *line, byte *dst, int pitch, int width, int factor, bool packed) =
+    upscale_nearest32_all_scalar;
+static void (*upscale_scale2x16)(const uint16_t *above, const uint16_t *line, const uint16_t *below,
+                                 byte *dst, int pitch, int width) = upscale_scale2x16_all_scalar;
+static void (*upscale_scale2x32)(const uint32_t *above, const uint32_t *line, const uint32_t *below,
+                                 byte *dst, int pitch, int width, bool packed) = upscale_scale2x32_all_scalar;
+
+
+
+// x86 Scalers
+
+#ifdef UPSCALE_X86
+
+// pshufb masks making destination vector k of a source vector, by factor:
+// 16-bit lanes, 32-bit lanes, and 32-bit lanes packed to R, G, B bytes
+static __m128i upscale_widen16[5][4], upscale_widen32[5][4], upscale_widen888[5][4];
+
+// Packs four 32-bit pixels into 12 bytes, the other 4 are zeroed
+#define UPSCALE_PACK888 (upscale_widen888[1][0])
+
+// A packed RGB888 vector holds 12 bytes but is stored as 16; the next
+// store covers the extra 4, so the last source pixel of each row is left
+// to the scalar code to keep them inside the row.
+
+// Widens the vectors of source pixels in line[0..end) and stores them on
+// every destination row. Inlined with a constant factor, so that the masks
+// and the destination vectors stay in registers. Returns the first source
+// pixel left over.
+__attribute__((target("ssse3"), always_inline))
+static inline int upscale_nearest_ssse3(const byte *line, int end, int lanes, const __m128i *table,
+                                        byte *dst, int pitch, int factor, int stride)
+{
+    __m128i masks[4], o[4];
+    int x, k, r;
+    for (k = 0; k < factor; k++)
+        masks[k] = table[k];
+    for (x = 0; x + lanes <= end; x += lanes) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (line + x * (16 / lanes)));
+        for (k = 0; k < factor; k++)
+            o[k] = _mm_shuffle_epi8(v, masks[k]);
+        byte *out = dst + x * factor * stride / lanes;
+        for (r = 0; r < factor; r++)
+            for (k = 0; k < factor; k++)
+                _mm_storeu_si128((__m128i *) (out + r * pitch + k * stride), o[k]);
+    }
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static void upscale_nearest16_ssse3(const uint16_t *line, byte *dst, int pitch, int width, int factor)
+{
+    const __m128i *masks = upscale_widen16[factor];
+    const byte *src = (const byte *) line;
+    int x;
+    switch (factor) {
+        case 2: x = upscale_nearest_ssse3(src, width, 8, masks, dst, pitch, 2, 16); break;
+        case 3: x = upscale_nearest_ssse3(src, width, 8, masks, dst, pitch, 3, 16); break;
+        default: x = upscale_nearest_ssse3(src, width, 8, masks, dst, pitch, 4, 16); break;
+    }
+    upscale_nearest16_scalar(line, dst, pitch, x, width, factor);
+}
+
+__attribute__((target("ssse3")))
+static void upscale_nearest32_ssse3(const uint32_t *line, byte *dst, int pitch, int width, int factor, bool packed)
+{
+    const __m128i *masks = packed ? upscale_widen888[factor] : upscale_widen32[factor];
+    const byte *src = (const byte *) line;
+    int stride = packed ? 12 : 16;
+    int end = packed ? width - 1 : width;
+    int x;
+    switch (factor) {
+        case 2: x = upscale_nearest_ssse3(src, end, 4, masks, dst, pitch, 2, stride); break;
+        case 3: x = upscale_nearest_ssse3(src, end, 4, masks, dst, pitch, 3, stride); break;
+        default: x = upscale_nearest_ssse3(src, end, 4, masks, dst, pitch, 4, stride); break;
+    }
+    upscale_nearest32_scalar(line, dst, pitch, x, width, factor, packed);
+}
+
+// Blends in the neighbours picked by the EPX masks, see UPSCALE_EPX
+#define UPSCALE_EPX_SIMD(cmpeq, a, b, c, d, p, e) \
+    do { \
+        __m128i eca = cmpeq(c, a), ecd = cmpeq(c, d), eab = cmpeq(a, b), ebd = cmpeq(b, d); \
+        __m128i m0 = _mm_andnot_si128(_mm_or_si128(ecd, eab), eca); \
+        __m128i m1 = _mm_andnot_si128(_mm_or_si128(eca, ebd), eab); \
+        __m128i m2 = _mm_andnot_si128(_mm_or_si128(ebd, eca), ecd); \
+        __m128i m3 = _mm_andnot_si128(_mm_or_si128(eab, ecd), ebd); \
+        e[0] = _mm_or_si128(_mm_and_si128(m0, a), _mm_andnot_si128(m0, p)); \
+        e[1] = _mm_or_si128(_mm_and_si128(m1, b), _mm_andnot_si128(m1, p)); \
+        e[2] = _mm_or_si128(_mm_and_si128(m2, c), _mm_andnot_si128(m2, p)); \
+        e[3] = _mm_or_si128(_mm_and_si128(m3, d), _mm_andnot_si128(m3, p)); \
+    } while (0)
+
+__attribute__((target("ssse3")))
+static void upscale_scale2x16_ssse3(const uint16_t *above, const uint16_t *line, const uint16_t *below,
+                                    byte *dst, int pitch, int width)
+{
+    __m128i e[4];
+    int x;
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (above + x));
+        __m128i b = _mm_loadu_si128((const __m128i *) (line + x + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *) (line + x - 1));
+        __m128i d = _mm_loadu_si128((const __m128i *) (below + x));
+        __m128i p = _mm_loadu_si128((const __m128i *) (line + x));
+        UPSCALE_EPX_SIMD(_mm_cmpeq_epi16, a, b, c, d, p, e);
+
+        byte *top = dst + x * 4, *bottom = top + pitch;
+        _mm_storeu_si128((__m128i *) top,             _mm_unpacklo_epi16(e[0], e[1]));
+        _mm_storeu_si128((__m128i *) (top + 16),      _mm_unpackhi_epi16(e[0], e[1]));
+        _mm_storeu_si128((__m128i *) bottom,          _mm_unpacklo_epi16(e[2], e[3]));
+        _mm_storeu_si128((__m128i *) (bottom + 16),   _mm_unpackhi_epi16(e[2], e[3]));
+    }
+    upscale_scale2x16_scalar(above, line, below, dst, pitch, x, width);
+}
+
+__attribute__((target("ssse3")))
+static void upscale_scale2x32_ssse3(const uint32_t *above, const uint32_t *line, const uint32_t *below,
+                                    byte *dst, int pitch, int width, bool packed)
+{
+    __m128i pack = UPSCALE_PACK888;
+    int stride = packed ? 12 : 16;
+    int end = packed ? width - 1 : width;
+    __m128i e[4], o[4];
+    int x, k;
+    for (x = 0; x + 4 <= end; x += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (above + x));
+        __m128i b = _mm_loadu_si128((const __m128i *) (line + x + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *) (line + x - 1));
+        __m128i d = _mm_loadu_si128((const __m128i *) (below + x));
+        __m128i p = _mm_loadu_si128((const __m128i *) (line + x));
+        UPSCALE_EPX_SIMD(_mm_cmpeq_epi32, a, b, c, d, p, e);
+
+        o[0] = _mm_unpacklo_epi32(e[0], e[1]);
+        o[1] = _mm_unpackhi_epi32(e[0], e[1]);
+        o[2] = _mm_unpacklo_epi32(e[2], e[3]);
+        o[3] = _mm_unpackhi_epi32(e[2], e[3]);
+        if (packed) {
+            for (k = 0; k < 4; k++)
+                o[k] = _mm_shuffle_epi8(o[k], pack);
+        }
+
+        byte *top = dst + x * 2 * (packed ? 3 : 4), *bottom = top + pitch;
+        _mm_storeu_si128((__m128i *) top,                o[0]);
+        _mm_storeu_si128((__m128i *) (top + stride),     o[1]);
+        _mm_storeu_si128((__m128i *) bottom,             o[2]);
+        _mm_storeu_si128((__m128i *) (bottom + stride),  o[3]);
+    }
+    upscale_scale2x32_scalar(above, line, below, dst, pitch, x, width, packed);
+}
+
+static __m128i upscale_build_mask(int lane, int factor, int k, bool packed)
+{
+    byte m[16];
+    int j;
+    for (j = 0; j < 16; j++) {
+        if (packed) {
+            // Byte j is channel j % 3 (R, G, B) of pixel j / 3, bytes
+            // 12 - 15 are zeroed
+            int source = (4 * k + j / 3) / factor;
+            m[j] = j < 12 ? source * 4 + 2 - j % 3 : 0x80;
+        }
+        else {
+            int source = ((16 / lane) * k + j / lane) / factor;
+            m[j] = source * lane + j % lane;
+        }
+    }
+    return _mm_loadu_si128((const __m128i *) m);
+}
+
+static void upscale_init_simd()
+{
+    int factor, k;
+
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("ssse3"))
+        return;
+
+    for (factor = 1; factor <= 4; factor++) {
+        for (k = 0; k < factor; k++) {
+            upscale_widen16[factor][k] = upscale_build_mask(2, factor, k, false);
+            upscale_widen32[factor][k] = upscale_build_mask(4, factor, k, false);
+            upscale_widen888[factor][k] = upscale_build_mask(4, factor, k, true);
+        }
+    }
+
+    upscale_nearest16 = upscale_nearest16_ssse3;
+    upscale_nearest32 = upscale_nearest32_ssse3;
+    upscale_scale2x16 = upscale_scale2x16_ssse3;
+    upscale_scale2x32 = upscale_scale2x32_ssse3;
+}
+
+#endif
+
+
+
+// Public Interface
+
+void upscale_disable_simd()
+{
+    upscale_nearest16 = upscale_nearest16_all_scalar;
+    upscale_nearest32 = upscale_nearest32_all_scalar;
+    upscale_scale2x16 = upscale_scale2x16_all_scalar;
+    upscale_scale2x32 = upscale_scale2x32_all_scalar;
+}
+
+void upscale_init()
+{
+#ifdef UPSCALE_X86
+    upscale_init_simd();
+#endif
+}
+
+int upscale_factor(upscale_mode mode)
+{
+    switch (mode) {
+        case UPSCALE_2X: return 2;
+        case UPSCALE_3X: return 3;
+        case UPSCALE_4X: return 4;
+        case UPSCALE_SCALE2X: return 2;
+        default: return 1;
+    }
+}
+
+// Converts a source row into line buffer i and pads it with its edge
+// pixels, returns the first pixel
+static void *upscale_convert_line(int i, bool wide, const byte *src, int width, int bank)
+{
+    if (wide) {
+        uint32_t *line = upscale_lines[i] + UPSCALE_PAD;
+        pixfmt_convert_line(PIXFMT_XRGB8888, src, line, width, bank);
+        line[-1] = line[0];
+        line[width] = line[width - 1];
+        return line;
+    }
+    uint16_t *line = (uint16_t *) (upscale_lines[i] + UPSCALE_PAD);
+    pixfmt_convert_line(PIXFMT_RGB565, src, line, width, bank);
+    line[-1] = line[0];
+    line[width] = line[width - 1];
+    return line;
+}
+
+void upscale_convert_frame(upscale_mode mode, pixfmt fmt, const byte *src, int src_pitch, const byte *banks,
+                           void *dst, int dst_pitch, int width, int height)
+{
+    int factor = upscale_factor(mode);
+    bool wide = fmt != PIXFMT_RGB565;
+    bool packed = fmt == PIXFMT_RGB888;
+    byte *out = (byte *) dst;
+    int y;
+
+    if (factor == 1 || width > UPSCALE_MAX_WIDTH || width <= 0 || height <= 0) {
+        if (factor == 1)
+            pixfmt_convert_frame(fmt, src, src_pitch, banks, dst, dst_pitch, width, height);
+        return;
+    }
+    if (mode != UPSCALE_SCALE2X) {
+        for (y = 0; y < height; y++) {
+            void *line = upscale_convert_line(0, wide, src + y * src_pitch, width, banks ? banks[y] : 0);
+            if (wide)
+                upscale_nearest32(line, out, dst_pitch, width, factor, packed);
+            else
+                upscale_nearest16(line, out, dst_pitch, width, factor);
+            out += factor * dst_pitch;
+        }
+        return;
+    }
+
+    // The rows above the first and below the last are taken as copies of them
+    int above = 0, current = 1, below = 2;
+    void *lines[3];
+    lines[current] = upscale_convert_line(current, wide, src, width, banks ? banks[0] : 0);
+    lines[above] = lines[current];
+    for (y = 0; y < height; y++) {
+        if (y + 1 < height)
+            lines[below] = upscale_convert_line(below, wide, src + (y + 1) * src_pitch, width,
+                                                banks ? banks[y + 1] : 0);
+        else
+            lines[below] = lines[current];
+
+        if (wide)
+            upscale_scale2x32(lines[above], lines[current], lines[below], out, dst_pitch, width, packed);
+        else
+            upscale_scale2x16(lines[above], lines[current], lines[below], out, dst_pitch, width);
+        out += 2 * dst_pitch;
+
+        int spare = above;
+        above = current;
+        current = below;
+        below = spare;
+    }
+}
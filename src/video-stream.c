@@ -0,0 +1,113 @@
+/*
+Raw video encoding for the stream backend, see video-stream.h.
+
+Y4M planes are looked up straight from the color codes: the palette is
+converted to YUV once per emphasis bank, and each plane of a row is one
+pixfmt_lookup_line() call, which is as fast as the RGB conversion. For
+4:2:0 the chroma of each 2x2 block is the average of its four pixels.
+*/
+#ifndef YATCPU
+
+#include "video-stream.h"
+#include "nes.h"
+#include "pixfmt.h"
+
+// NTSC frame rate, 39375000 / 655171 = 60.0988 Hz, and pixel aspect ratio
+#define VIDEO_STREAM_Y4M_PARAMS "F39375000:655171 Ip A8:7"
+
+static byte video_y[PIXFMT_BANKS][64], video_u[PIXFMT_BANKS][64], video_v[PIXFMT_BANKS][64];
+
+void video_stream_init()
+{
+    int bank, i;
+
+    // BT.601, Y in 16 - 235 and U, V in 16 - 240; the chroma sums are
+    // offset to stay positive before the shift
+    for (bank = 0; bank < PIXFMT_BANKS; bank++) {
+        for (i = 0; i < 64; i++) {
+            int r = (pixfmt_xrgb8888[bank][i] >> 16) & 0xFF;
+            int g = (pixfmt_xrgb8888[bank][i] >> 8) & 0xFF;
+            int b = pixfmt_xrgb8888[bank][i] & 0xFF;
+            video_y[bank][i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            video_u[bank][i] = (-38 * r - 74 * g + 112 * b + 128 + (128 << 8)) >> 8;
+            video_v[bank][i] = (112 * r - 94 * g - 18 * b + 128 + (128 << 8)) >> 8;
+        }
+    }
+}
+
+int video_stream_header(video_stream_format format, char *out, int size)
+{
+    switch (format) {
+        case VIDEO_STREAM_Y4M:
+            return snprintf(out, size, "YUV4MPEG2 W%d H%d " VIDEO_STREAM_Y4M_PARAMS " C444\n",
+                            SCREEN_WIDTH, SCREEN_HEIGHT);
+        case VIDEO_STREAM_Y4M_420:
+            return snprintf(out, size, "YUV4MPEG2 W%d H%d " VIDEO_STREAM_Y4M_PARAMS " C420jpeg\n",
+                            SCREEN_WIDTH, SCREEN_HEIGHT);
+        default:
+            return 0;
+    }
+}
+
+size_t video_stream_frame_size(video_stream_format format)
+{
+    size_t pixels = SCREEN_WIDTH * SCREEN_HEIGHT;
+
+    switch (format) {
+        case VIDEO_STREAM_Y4M: return 6 + pixels * 3;
+        case VIDEO_STREAM_Y4M_420: return 6 + pixels + pixels / 2;
+        default: return pixels * 3;
+    }
+}
+
+// Averages the chroma of each 2x2 block of rows y and y + 1
+static void video_stream_subsample(const byte *table0, const byte *table1,
+                                   const byte *row0, const byte *row1, byte *out)
+{
+    byte c0[SCREEN_WIDTH], c1[SCREEN_WIDTH];
+    int x;
+
+    pixfmt_lookup_line(table0, row0, c0, SCREEN_WIDTH);
+    pixfmt_lookup_line(table1, row1, c1, SCREEN_WIDTH);
+    for (x = 0; x < SCREEN_WIDTH / 2; x++)
+        out[x] = (c0[2 * x] + c0[2 * x + 1] + c1[2 * x] + c1[2 * x + 1] + 2) >> 2;
+}
+
+void video_stream_encode(video_stream_format format, const byte *frame, const byte *banks, byte *out)
+{
+    const int w = SCREEN_WIDTH, h = SCREEN_HEIGHT;
+    int y;
+
+    if (format == VIDEO_STREAM_RGB24) {
+        pixfmt_convert_frame(PIXFMT_RGB888, frame, w, banks, out, w * 3, w, h);
+        return;
+    }
+
+    memcpy(out, "FRAME\n", 6);
+    byte *plane_y = out + 6;
+    byte *plane_u = plane_y + w * h;
+
+    if (format == VIDEO_STREAM_Y4M) {
+        byte *plane_v = plane_u + w * h;
+        for (y = 0; y < h; y++) {
+            int bank = banks ? banks[y] & (PIXFMT_BANKS - 1) : 0;
+            pixfmt_lookup_line(video_y[bank], frame + y * w, plane_y + y * w, w);
+            pixfmt_lookup_line(video_u[bank], frame + y * w, plane_u + y * w, w);
+            pixfmt_lookup_line(video_v[bank], frame + y * w, plane_v + y * w, w);
+        }
+        return;
+    }
+
+    byte *plane_v = plane_u + (w / 2) * (h / 2);
+    for (y = 0; y < h; y += 2) {
+        int bank0 = banks ? banks[y] & (PIXFMT_BANKS - 1) : 0;
+        int bank1 = banks ? banks[y + 1] & (PIXFMT_BANKS - 1) : 0;
+        const byte *row0 = frame + y * w, *row1 = row0 + w;
+        pixfmt_lookup_line(video_y[bank0], row0, plane_y + y * w, w);
+        pixfmt_lookup_line(video_y[bank1], row1, plane_y + (y + 1) * w, w);
+        video_stream_subsample(video_u[bank0], video_u[bank1], row0, row1, plane_u + (y / 2) * (w / 2));
+        video_stream_subsample(video_v[bank0], video_v[bank1], row0, row1, plane_v + (y / 2) * (w / 2));
+    }
+}
+
+#endif